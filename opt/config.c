@@ -36,6 +36,8 @@ static char             m_config_filename[PCBP_CONFIG_FILENAME_MAXLEN+1];
 static uint32_t         m_config_timestamp;
 static uint32_t         m_check_ms;
 static absolute_time_t  m_next_check;
+static bool             m_watching;
+static volatile bool    m_changed;
 
 
 /* Functions. */
@@ -116,6 +118,18 @@ static void config_fetch( void )
 }
 
 
+/*
+ * changed - called by usbfs when the host has changed the configuration file;
+ *           it's simply noted, to be picked up by the next config_check().
+ */
+
+static void config_changed( const char *p_filename )
+{
+  m_changed = true;
+  return;
+}
+
+
 /* Public functions. */
 
 /*
@@ -150,6 +164,12 @@ void config_load( const char *p_filename,
     }
   }
 
+  /* Stop watching any previous configuration file. */
+  if ( m_watching )
+  {
+    usbfs_watch( m_config_filename, NULL );
+  }
+
   /*
    * Save the configuration filename, and record it's current timestamp, so
    * that we can monitor it for changes later.
@@ -160,6 +180,13 @@ void config_load( const char *p_filename,
   m_check_ms = p_frequency * 1000;
   m_next_check = make_timeout_time_ms( m_check_ms );
 
+  /*
+   * Ideally, usbfs will tell us when the host changes the file; we only have
+   * to poll its timestamp if that can't be arranged.
+   */
+  m_changed = false;
+  m_watching = usbfs_watch( m_config_filename, config_changed );
+
   /* Now just load up the details in that file. */
   config_fetch();
 
@@ -212,8 +239,10 @@ bool config_save( void )
 
 /*
  * check - looks to see if the configuration file has changed since the last
- *         time it was read. Will only do this at the frequency specified when
- *         the configuration was initially loaded.
+ *         time it was read. If the file is being watched, this is just a case
+ *         of seeing if usbfs has told us about a change; otherwise, the file's
+ *         timestamp is checked at the frequency specified when the
+ *         configuration was initially loaded.
  *         True is returned if the file has changed and been re-loaded; 
  *         false otherwise.
  */
@@ -222,6 +251,19 @@ bool config_check( void )
 {
   uint32_t    l_timestamp;
 
+  /* If usbfs is watching the file for us, there's no need to go looking. */
+  if ( m_watching )
+  {
+    if ( !m_changed )
+    {
+      return false;
+    }
+    m_changed = false;
+    m_config_timestamp = usbfs_timestamp( m_config_filename );
+    config_fetch();
+    return true;
+  }
+
   /* Have we reached the next check time? */
   if ( !time_reached( m_next_check ) )
   {
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 
 #include "pico/stdlib.h"
+#include "hardware/flash.h"
 
 /* Local headers. */
 
@@ -58,7 +59,7 @@ DRESULT disk_read( BYTE pdrv, BYTE *buff, LBA_t sector, UINT count )
   static_assert( FF_MIN_SS == FF_MAX_SS, "FatFS Sector Size not fixed!" );
 
   /* Ask the storage layer to perform the read. */
-  l_bytecount = storage_read( sector, 0, buff, FF_MIN_SS*count );
+  l_bytecount = storage_read( pdrv, sector, 0, buff, FF_MIN_SS*count );
 
   /* Check that we wrote as much data as expected. */
   if ( l_bytecount != FF_MIN_SS*count )
@@ -77,20 +78,35 @@ DRESULT disk_read( BYTE pdrv, BYTE *buff, LBA_t sector, UINT count )
 
 DRESULT disk_write( BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count )
 {
-  int32_t l_bytecount;
+  int32_t  l_bytecount;
+  uint32_t l_done;
 
   /* Make sure that we have a fixed sector size. */
   static_assert( FF_MIN_SS == FF_MAX_SS, "FatFS Sector Size not fixed!" );
 
-  /* Ask the storage layer to perform the write. */
-  l_bytecount = storage_write( sector, 0, buff, FF_MIN_SS*count );
-
-  /* Check that we wrote as much data as expected. */
-  if ( l_bytecount != FF_MIN_SS*count )
+  /* 
+   * Ask the storage layer to perform the write; large writes can go straight
+   * to flash, in whole blocks. If it's busy, it may not take all the data
+   * straight away, but each attempt moves things along, so just keep asking;
+   * if the flash can't be written at all, it will give up and tell us.
+   */
+  for ( l_done = 0; l_done < FF_MIN_SS*count; l_done += l_bytecount )
   {
-    return RES_ERROR;
+    l_bytecount = storage_write_bulk( pdrv, sector, l_done, buff + l_done, FF_MIN_SS*count - l_done );
+    if ( l_bytecount < 0 )
+    {
+      return RES_ERROR;
+    }
   }
 
+  /* Keep track of what's changed, in case the host needs to know. */
+  usb_note_local_write( pdrv, sector, count );
+
+#if USBFS_VIRTUAL_FILES > 0
+  /* If that reused a virtual file's clusters, they now hold a real file. */
+  virtual_write( pdrv, sector, 0, FF_MIN_SS*count );
+#endif
+
   /* All went well then. */
   return RES_OK;
 }
@@ -110,17 +126,26 @@ DRESULT disk_ioctl( BYTE pdrv, BYTE cmd, void* buff )
   switch(cmd)
   {
     case CTRL_SYNC: 
-      /* We have no cache, so we're always synced. */
-      return RES_OK;
+      /* Make sure anything in the write cache is committed to flash. */
+      return storage_flush() ? RES_OK : RES_ERROR;
 
     case GET_SECTOR_COUNT:
       /* Just ask the storage layer for this data. */
-      storage_get_size( &block_size, &num_blocks );
+      storage_get_size( pdrv, &block_size, &num_blocks );
       *(LBA_t *)buff = num_blocks;
       return RES_OK;
 
     case GET_BLOCK_SIZE:
-      *(DWORD *)buff = 1;
+      /* 
+       * If we can erase whole blocks, ask FatFS to align its data to them
+       * when formatting, so that large writes can make use of them; failing
+       * that, at least keep clusters from straddling flash sectors.
+       */
+#if USBFS_BLOCK_ERASE && !USBFS_WEAR_LEVEL
+      *(DWORD *)buff = FLASH_BLOCK_SIZE / FF_MIN_SS;
+#else
+      *(DWORD *)buff = FLASH_SECTOR_SIZE / FF_MIN_SS;
+#endif
       return RES_OK;
   }
 
@@ -34,15 +34,15 @@
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_FASTSEEK	0
+#define FF_USE_FASTSEEK	1
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_EXPAND	0
+#define FF_USE_EXPAND	1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_CHMOD	0
+#define FF_USE_CHMOD	1
 /* This option switches attribute manipulation functions, f_chmod() and f_utime().
 /  (0:Disable or 1:Enable) Also FF_FS_READONLY needs to be 0 to enable this option. */
 
@@ -166,7 +166,11 @@
 / Drive/Volume Configurations
 /---------------------------------------------------------------------------*/
 
+#if defined( USBFS_SCRATCH_SECTORS ) && ( USBFS_SCRATCH_SECTORS > 0 )
+#define FF_VOLUMES		2
+#else
 #define FF_VOLUMES		1
+#endif
 /* Number of volumes (logical drives) to be used. (1-10) */
 
 
@@ -193,8 +197,13 @@
 /  function will be available. */
 
 
+#if defined( USBFS_BLOCK_SIZE )
+#define FF_MIN_SS		USBFS_BLOCK_SIZE
+#define FF_MAX_SS		USBFS_BLOCK_SIZE
+#else
 #define FF_MIN_SS		4096
 #define FF_MAX_SS		4096
+#endif
 /* This set of options configures the range of sector size to be supported. (512,
 /  1024, 2048 or 4096) Always set both 512 for most systems, generic memory card and
 /  harddisk, but a larger value may be required for on-board flash memory and some
@@ -224,7 +233,11 @@
 / System Configurations
 /---------------------------------------------------------------------------*/
 
+#if defined( USBFS_TINY ) && USBFS_TINY
+#define FF_FS_TINY		1
+#else
 #define FF_FS_TINY		0
+#endif
 /* This option switches tiny buffer configuration. (0:Normal or 1:Tiny)
 /  At the tiny configuration, size of file object (FIL) is shrinked FF_MAX_SS bytes.
 /  Instead of private sector buffer eliminated from the file object, common sector
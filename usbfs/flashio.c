@@ -0,0 +1,368 @@
+/*
+ * usbfs/flashio.c - part of the PicoW C/C++ Boilerplate Project
+ *
+ * These functions are the lowest level of the storage stack; they provide raw
+ * access to the region of flash that usbfs keeps its filesystem in. All the
+ * addresses used here are relative to the start of that region.
+ *
+ * The placement and size of the region are decided by the storage layer, as
+ * they depend on the build configuration and on how much room wear levelling
+ * needs; all we can tell it is where the program ends.
+ *
+ * Erasing or programming flash makes it unreadable for the duration, so nothing
+ * may execute from flash on *either* core while it happens. We use the SDK's
+ * flash_safe_execute() for this, which disables interrupts on this core and,
+ * if the other core is running (and has called flash_safe_execute_core_init()),
+ * parks it in RAM until each individual erase or program is complete.
+ *
+ * Reads normally go through the XIP streaming interface, with DMA doing the
+ * copying; this is much faster than reading the uncached XIP window a word at
+ * a time, and leaves the CPU free to do other things while the data arrives
+ * (see flashio_read_start()). Reads which aren't word aligned fall back to a
+ * simple copy. Optionally, reads can instead go through the XIP cache, which
+ * suits small, frequently read data; the SDK flushes that cache after every
+ * erase or program, so it never returns stale data.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+/* System headers. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/flash.h"
+#include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/structs/xip_ctrl.h"
+
+
+/* Local headers. */
+
+#include "usbfs.h"
+
+
+/* Structures. */
+
+typedef struct
+{
+  uint32_t        offset;
+  const uint8_t  *buffer;
+  uint32_t        size;
+  uint32_t        duration_us;
+} flashio_op_t;
+
+
+/* Linker symbols. */
+
+extern char __flash_binary_end;
+
+
+/* Module variables. */
+
+static uint32_t m_flash_size;
+static uint32_t m_flash_offset;
+static int      m_dma_channel = -1;
+
+
+/* Functions.*/
+
+/*
+ * init - records where our region of flash lives; this is an offset from the
+ *        start of flash.
+ */
+
+void flashio_init( uint32_t p_offset, uint32_t p_size_bytes )
+{
+  /* Just remember these, for later. */
+  m_flash_offset = p_offset;
+  m_flash_size = p_size_bytes;
+
+  /* And grab a DMA channel for reads, if there's one going spare. */
+  if ( m_dma_channel < 0 )
+  {
+    m_dma_channel = dma_claim_unused_channel( false );
+  }
+
+  /* All done. */
+  return;
+}
+
+
+/*
+ * get_free - returns the offset of the first sector of flash that isn't used
+ *            by our program binary.
+ */
+
+uint32_t flashio_get_free( void )
+{
+  uint32_t l_end;
+
+  /* The linker tells us where the binary ends; round up to a whole sector. */
+  l_end = (uint32_t)&__flash_binary_end - XIP_BASE;
+  return ( l_end + FLASH_SECTOR_SIZE - 1 ) & ~( FLASH_SECTOR_SIZE - 1 );
+}
+
+
+/*
+ * get_size - returns the size of our region of flash, in bytes.
+ */
+
+uint32_t flashio_get_size( void )
+{
+  return m_flash_size;
+}
+
+
+/*
+ * read_start - begins reading data from flash, using DMA from the XIP stream.
+ *              The CPU is free to carry on while the data arrives; use
+ *              flashio_read_busy() to see when it's done. Returns false if
+ *              the read can't be done this way (because it isn't word aligned
+ *              or we have no DMA channel), in which case nothing is started.
+ */
+
+bool flashio_read_start( uint32_t p_address, void *p_buffer, uint32_t p_size_bytes )
+{
+  dma_channel_config l_config;
+
+  /* The stream works in whole, aligned words. */
+  if ( ( m_dma_channel < 0 ) || ( ( p_address | (uint32_t)p_buffer | p_size_bytes ) & 3 ) )
+  {
+    return false;
+  }
+
+  /* Only one read at a time, and make sure the stream FIFO is empty. */
+  dma_channel_wait_for_finish_blocking( m_dma_channel );
+  while( !( xip_ctrl_hw->stat & XIP_STAT_FIFO_EMPTY ) )
+  {
+    (void)xip_ctrl_hw->stream_fifo;
+  }
+
+  /* Point the stream at the data we want. */
+  xip_ctrl_hw->stream_addr = XIP_NOCACHE_NOALLOC_BASE + m_flash_offset + p_address;
+  xip_ctrl_hw->stream_ctr = p_size_bytes / sizeof( uint32_t );
+
+  /* And have the DMA copy it out of the FIFO as it arrives. */
+  l_config = dma_channel_get_default_config( m_dma_channel );
+  channel_config_set_read_increment( &l_config, false );
+  channel_config_set_write_increment( &l_config, true );
+  channel_config_set_dreq( &l_config, DREQ_XIP_STREAM );
+  dma_channel_configure( 
+    m_dma_channel, &l_config, p_buffer, (const void *)XIP_AUX_BASE, 
+    p_size_bytes / sizeof( uint32_t ), true 
+  );
+
+  /* All started. */
+  stats_read( p_size_bytes );
+  return true;
+}
+
+
+/*
+ * read_busy - returns true if a read started by flashio_read_start() is still
+ *             in progress.
+ */
+
+bool flashio_read_busy( void )
+{
+  return ( m_dma_channel >= 0 ) && dma_channel_is_busy( m_dma_channel );
+}
+
+
+/*
+ * read - copies data out of flash, waiting until it's done; we use the XIP
+ *        stream where we can, or the uncached XIP window otherwise, so that
+ *        we don't disturb the cache that the running code relies on.
+ */
+
+void flashio_read( uint32_t p_address, void *p_buffer, uint32_t p_size_bytes )
+{
+  /* If we can stream it, do so and wait for it to arrive. */
+  if ( flashio_read_start( p_address, p_buffer, p_size_bytes ) )
+  {
+    dma_channel_wait_for_finish_blocking( m_dma_channel );
+    return;
+  }
+
+  /* Otherwise, a very simple copy out of flash then! */
+  memcpy( 
+    p_buffer, 
+    (uint8_t *)XIP_NOCACHE_NOALLOC_BASE + m_flash_offset + p_address, 
+    p_size_bytes
+  );
+  stats_read( p_size_bytes );
+
+  /* All done. */
+  return;
+}
+
+
+/*
+ * read_cached - copies data out of flash through the XIP cache; this is best
+ *               kept for small, frequently read data, as it competes with the
+ *               running code for space in the cache.
+ */
+
+void flashio_read_cached( uint32_t p_address, void *p_buffer, uint32_t p_size_bytes )
+{
+  /* Make sure a streamed read isn't still in the middle of things. */
+  if ( m_dma_channel >= 0 )
+  {
+    dma_channel_wait_for_finish_blocking( m_dma_channel );
+  }
+
+  /* And copy from the cached window. */
+  memcpy( p_buffer, (uint8_t *)XIP_BASE + m_flash_offset + p_address, p_size_bytes );
+  stats_read( p_size_bytes );
+  return;
+}
+
+
+/*
+ * do_erase - called by flash_safe_execute() to perform an erase, once it is
+ *            safe to do so; interrupts are disabled throughout, so we time it.
+ */
+
+static void flashio_do_erase( void *p_param )
+{
+  flashio_op_t *l_op = (flashio_op_t *)p_param;
+  uint32_t      l_start = time_us_32();
+
+  flash_range_erase( l_op->offset, l_op->size );
+  l_op->duration_us = time_us_32() - l_start;
+  return;
+}
+
+
+/*
+ * do_program - called by flash_safe_execute() to perform a program, once it
+ *              is safe to do so; again, we time it.
+ */
+
+static void flashio_do_program( void *p_param )
+{
+  flashio_op_t *l_op = (flashio_op_t *)p_param;
+  uint32_t      l_start = time_us_32();
+
+  flash_range_program( l_op->offset, l_op->buffer, l_op->size );
+  l_op->duration_us = time_us_32() - l_start;
+  return;
+}
+
+
+/*
+ * erase - erases a single sector of flash, once both cores are safely out of
+ *         the way. Returns false if that couldn't be arranged in time, in which
+ *         case nothing has been erased.
+ */
+
+bool flashio_erase( uint32_t p_address )
+{
+  flashio_op_t l_op;
+
+  /* Any streamed read must be finished before the flash goes away. */
+  if ( m_dma_channel >= 0 )
+  {
+    dma_channel_wait_for_finish_blocking( m_dma_channel );
+  }
+
+  /* Set up the operation. */
+  l_op.offset = m_flash_offset + p_address;
+  l_op.buffer = NULL;
+  l_op.size = FLASH_SECTOR_SIZE;
+
+  /* Ask the SDK to run it for us. */
+  if ( flash_safe_execute( flashio_do_erase, &l_op, USBFS_FLASH_TIMEOUT_MS ) != PICO_OK )
+  {
+    return false;
+  }
+
+  /* And keep count. */
+  stats_erase( p_address, FLASH_SECTOR_SIZE, l_op.duration_us );
+  return true;
+}
+
+
+/*
+ * block_offset - returns how far into a 64kb erase block the given address is;
+ *                block erases can only be used on whole, aligned blocks, and
+ *                our region doesn't necessarily start on a block boundary.
+ */
+
+uint32_t flashio_block_offset( uint32_t p_address )
+{
+  return ( m_flash_offset + p_address ) % FLASH_BLOCK_SIZE;
+}
+
+
+/*
+ * erase_block - erases a whole 64kb block of flash in one go; this takes
+ *               about three times as long as a single sector erase, but that
+ *               is still far quicker than erasing the sixteen sectors one at a
+ *               time. The address must be block aligned (see above).
+ */
+
+bool flashio_erase_block( uint32_t p_address )
+{
+  flashio_op_t l_op;
+
+  /* Any streamed read must be finished before the flash goes away. */
+  if ( m_dma_channel >= 0 )
+  {
+    dma_channel_wait_for_finish_blocking( m_dma_channel );
+  }
+
+  /* Set up the operation; the SDK uses a block erase for aligned blocks. */
+  l_op.offset = m_flash_offset + p_address;
+  l_op.buffer = NULL;
+  l_op.size = FLASH_BLOCK_SIZE;
+
+  /* Ask the SDK to run it for us. */
+  if ( flash_safe_execute( flashio_do_erase, &l_op, USBFS_FLASH_TIMEOUT_MS ) != PICO_OK )
+  {
+    return false;
+  }
+
+  /* And keep count. */
+  stats_erase( p_address, FLASH_BLOCK_SIZE, l_op.duration_us );
+  return true;
+}
+
+
+/*
+ * program - writes data into (erased) flash, once both cores are safely out of
+ *           the way. Both the address and size must be multiples of
+ *           FLASH_PAGE_SIZE. Returns false if nothing could be written.
+ */
+
+bool flashio_program( uint32_t p_address, const void *p_buffer, uint32_t p_size_bytes )
+{
+  flashio_op_t l_op;
+
+  /* Any streamed read must be finished before the flash goes away. */
+  if ( m_dma_channel >= 0 )
+  {
+    dma_channel_wait_for_finish_blocking( m_dma_channel );
+  }
+
+  /* Set up the operation. */
+  l_op.offset = m_flash_offset + p_address;
+  l_op.buffer = p_buffer;
+  l_op.size = p_size_bytes;
+
+  /* Ask the SDK to run it for us. */
+  if ( flash_safe_execute( flashio_do_program, &l_op, USBFS_FLASH_TIMEOUT_MS ) != PICO_OK )
+  {
+    return false;
+  }
+
+  /* And keep count. */
+  stats_program( p_size_bytes, l_op.duration_us );
+  return true;
+}
+
+
+/* End of file usbfs/flashio.c */
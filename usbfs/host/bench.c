@@ -0,0 +1,330 @@
+/*
+ * usbfs/host/bench.c - part of the PicoW C/C++ Boilerplate Project
+ *
+ * A small benchmark for usbfs, run on a Linux host against the flash emulator
+ * in flashio_host.c. It runs a few typical workloads (saving a configuration
+ * file with opt/config.c, appending to a log, writing a larger file) and
+ * reports the flash operations each one caused, the write amplification, and
+ * the modelled flash time taken by each operation. The flash statistics for
+ * the whole run are left in stats.csv on the volume.
+ *
+ * It also reports the RAM taken by the filesystem and file handles, and copies
+ * the large file in small pieces, to show the cost of USBFS_TINY; there, the
+ * two open files have to share the filesystem's sector buffer. Finally, it
+ * reads from random places in the large file, with and without a fast-seek
+ * link map (see usbfs_fastseek()), to show what following the FAT costs.
+ *
+ * Usage: usbfs_bench [iterations]
+ *
+ * The flash image persists between runs (see flashio_host.c); delete it to
+ * start from a freshly formatted volume.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+/* System headers. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+
+/* Local headers. */
+
+#include "usbfs.h"
+#include "opt/config.h"
+#include "flashio_host.h"
+
+
+/* Constants. */
+
+#define BENCH_DEFAULT_ITERATIONS  100
+#define BENCH_BULK_SIZE           ( 64 * 1024 )
+#define BENCH_STREAM_CHUNK        100
+#define BENCH_SEEK_CHUNK          64
+
+
+/* Structures. */
+
+typedef struct
+{
+  uint32_t  ops;
+  uint64_t  app_bytes;
+  uint64_t  total_us;
+  uint64_t  max_us;
+} bench_result_t;
+
+
+/* Functions.*/
+
+/*
+ * file_size - returns the size of the named file, by reading through it.
+ */
+
+static uint32_t bench_file_size( const char *p_pathname )
+{
+  usbfs_file_t *l_fileptr;
+  uint8_t       l_buffer[512];
+  uint32_t      l_size = 0;
+  size_t        l_count;
+
+  l_fileptr = usbfs_open( p_pathname, "r" );
+  if ( l_fileptr == NULL )
+  {
+    return 0;
+  }
+  while( ( l_count = usbfs_read( l_buffer, sizeof( l_buffer ), l_fileptr ) ) > 0 )
+  {
+    l_size += l_count;
+  }
+  usbfs_close( l_fileptr );
+  return l_size;
+}
+
+
+/*
+ * record - notes the modelled flash time taken by a single operation.
+ */
+
+static void bench_record( bench_result_t *p_result, uint64_t p_before_us, uint32_t p_bytes )
+{
+  flashio_host_counters_t l_counters;
+  uint64_t                l_taken;
+
+  flashio_host_get_counters( &l_counters );
+  l_taken = l_counters.busy_us - p_before_us;
+
+  p_result->ops++;
+  p_result->app_bytes += p_bytes;
+  p_result->total_us += l_taken;
+  if ( l_taken > p_result->max_us )
+  {
+    p_result->max_us = l_taken;
+  }
+  return;
+}
+
+
+/*
+ * report - prints out the results of a workload, along with the flash counters.
+ */
+
+static void bench_report( const char *p_name, const bench_result_t *p_result )
+{
+  flashio_host_counters_t l_counters;
+
+  flashio_host_get_counters( &l_counters );
+  printf( "%-8s %6u ops %9llu bytes | %6u erases %4u blocks %7u pages %5u violations | "
+          "WA %6.2f | latency avg %8.2fms max %8.2fms\n",
+          p_name, p_result->ops, (unsigned long long)p_result->app_bytes,
+          l_counters.erases, l_counters.block_erases, l_counters.programs, l_counters.violations,
+          p_result->app_bytes ? (double)l_counters.program_bytes / p_result->app_bytes : 0.0,
+          p_result->ops ? p_result->total_us / 1000.0 / p_result->ops : 0.0,
+          p_result->max_us / 1000.0 );
+  return;
+}
+
+
+/*
+ * stream - copies a file in small pieces, as an application parsing or
+ *          transforming it might, and reports on how long the copy took on
+ *          this host and the flash operations it caused.
+ */
+
+static void bench_stream( const char *p_from, const char *p_to, uint32_t p_iterations )
+{
+  flashio_host_counters_t l_counters;
+  usbfs_file_t           *l_source, *l_dest;
+  uint8_t                 l_buffer[BENCH_STREAM_CHUNK];
+  uint64_t                l_start_us, l_bytes = 0;
+  uint32_t                l_index;
+  size_t                  l_count;
+
+  flashio_host_reset_counters();
+  l_start_us = time_us_64();
+  for ( l_index = 0; l_index < p_iterations; l_index++ )
+  {
+    l_source = usbfs_open( p_from, "r" );
+    l_dest = usbfs_open( p_to, "w" );
+    if ( ( l_source == NULL ) || ( l_dest == NULL ) )
+    {
+      usbfs_close( l_source );
+      usbfs_close( l_dest );
+      return;
+    }
+    while( ( l_count = usbfs_read( l_buffer, sizeof( l_buffer ), l_source ) ) > 0 )
+    {
+      usbfs_write( l_buffer, l_count, l_dest );
+      l_bytes += l_count;
+    }
+    usbfs_close( l_source );
+    usbfs_close( l_dest );
+  }
+  storage_flush();
+
+  /* The time here is what this host spent in usbfs, not the modelled flash time. */
+  flashio_host_get_counters( &l_counters );
+  printf( "%-8s %6u ops %9llu bytes | %6u reads %9llu read bytes %7u pages | "
+          "host %8.2fms %8.2f MB/s\n",
+          "stream", p_iterations, (unsigned long long)l_bytes,
+          l_counters.reads, (unsigned long long)l_counters.read_bytes, l_counters.programs,
+          ( time_us_64() - l_start_us ) / 1000.0,
+          l_bytes / (double)( time_us_64() - l_start_us + 1 ) );
+  return;
+}
+
+
+/*
+ * seek - reads small pieces from random places in a file, optionally with a
+ *        fast-seek link map; like stream, this reports the reads made from
+ *        flash and the time this host spent in usbfs.
+ */
+
+static void bench_seek( const char *p_name, const char *p_from, uint32_t p_iterations,
+                        bool p_fastseek )
+{
+  flashio_host_counters_t l_counters;
+  usbfs_file_t           *l_source;
+  uint8_t                 l_buffer[BENCH_SEEK_CHUNK];
+  uint64_t                l_start_us, l_bytes = 0;
+  uint32_t                l_index;
+  long                    l_size;
+
+  l_source = usbfs_open( p_from, "r" );
+  if ( l_source == NULL )
+  {
+    return;
+  }
+  if ( p_fastseek && !usbfs_fastseek( l_source ) )
+  {
+    printf( "%-8s link map too small for %s\n", p_name, p_from );
+  }
+  usbfs_seek( l_source, 0, SEEK_END );
+  l_size = usbfs_tell( l_source );
+
+  /* The same offsets each time, so that both runs do the same work. */
+  srand( 1 );
+  flashio_host_reset_counters();
+  l_start_us = time_us_64();
+  for ( l_index = 0; l_index < p_iterations; l_index++ )
+  {
+    usbfs_seek( l_source, rand() % ( l_size - BENCH_SEEK_CHUNK ), SEEK_SET );
+    l_bytes += usbfs_read( l_buffer, sizeof( l_buffer ), l_source );
+  }
+  usbfs_close( l_source );
+
+  flashio_host_get_counters( &l_counters );
+  printf( "%-8s %6u ops %9llu bytes | %6u reads %9llu read bytes %7u pages | "
+          "host %8.2fms %8.2f MB/s\n",
+          p_name, p_iterations, (unsigned long long)l_bytes,
+          l_counters.reads, (unsigned long long)l_counters.read_bytes, l_counters.programs,
+          ( time_us_64() - l_start_us ) / 1000.0,
+          l_bytes / (double)( time_us_64() - l_start_us + 1 ) );
+  return;
+}
+
+
+/*
+ * main - runs each of the workloads in turn.
+ */
+
+int main( int argc, char **argv )
+{
+  const config_t          l_defaults[] = { { "COUNTER", "0" }, { "BLINK_RATE", "500" }, { "", "" } };
+  flashio_host_counters_t l_counters;
+  bench_result_t          l_result;
+  usbfs_file_t           *l_fileptr;
+  uint8_t                *l_bulk;
+  char                    l_buffer[64];
+  uint32_t                l_iterations, l_index, l_offset;
+
+  /* Work out how hard we're working. */
+  l_iterations = ( argc > 1 ) ? atoi( argv[1] ) : BENCH_DEFAULT_ITERATIONS;
+
+  /* Bring up the filesystem, formatting it if need be. */
+  usbfs_init();
+  storage_flush();
+
+  /* The RAM that the filesystem and the file handles take up. */
+  printf( "ram      %u x %u byte filesystems, %u x %u byte file handles; %u bytes%s\n",
+          USBFS_PARTITIONS, (unsigned)sizeof( FATFS ),
+          USBFS_MAX_FILES, (unsigned)sizeof( usbfs_file_t ),
+          (unsigned)( USBFS_PARTITIONS * sizeof( FATFS ) + USBFS_MAX_FILES * sizeof( usbfs_file_t ) ),
+          USBFS_TINY ? " (USBFS_TINY)" : "" );
+
+  /* First, repeatedly update and save a configuration file. */
+  memset( &l_result, 0, sizeof( bench_result_t ) );
+  flashio_host_reset_counters();
+  config_load( "config.txt", l_defaults, 1 );
+  for ( l_index = 0; l_index < l_iterations; l_index++ )
+  {
+    snprintf( l_buffer, sizeof( l_buffer ), "%u", l_index );
+    config_set( "COUNTER", l_buffer );
+    flashio_host_get_counters( &l_counters );
+    config_save();
+    bench_record( &l_result, l_counters.busy_us, 0 );
+
+    /* Measure the file separately, so that reading it isn't counted. */
+    l_result.app_bytes += bench_file_size( "config.txt" );
+  }
+  bench_report( "config", &l_result );
+
+  /* Next, append lines to a log file, one at a time. */
+  memset( &l_result, 0, sizeof( bench_result_t ) );
+  flashio_host_reset_counters();
+  for ( l_index = 0; l_index < l_iterations; l_index++ )
+  {
+    snprintf( l_buffer, sizeof( l_buffer ), "%08u: nothing much happened\n", l_index );
+    flashio_host_get_counters( &l_counters );
+    l_fileptr = usbfs_open( "log.txt", "a" );
+    usbfs_puts( l_buffer, l_fileptr );
+    usbfs_close( l_fileptr );
+    bench_record( &l_result, l_counters.busy_us, strlen( l_buffer ) );
+  }
+  bench_report( "log", &l_result );
+
+  /* And lastly, write a larger file in one go, a few times over. */
+  memset( &l_result, 0, sizeof( bench_result_t ) );
+  flashio_host_reset_counters();
+  l_bulk = malloc( BENCH_BULK_SIZE );
+  for ( l_index = 0; l_index < BENCH_BULK_SIZE; l_index++ )
+  {
+    l_bulk[l_index] = rand();
+  }
+  for ( l_index = 0; l_index < l_iterations / 10 + 1; l_index++ )
+  {
+    /* Change every sector a little, so each write really has to hit flash. */
+    for ( l_offset = 0; l_offset < BENCH_BULK_SIZE; l_offset += FLASH_SECTOR_SIZE )
+    {
+      l_bulk[l_offset]++;
+    }
+    flashio_host_get_counters( &l_counters );
+    l_fileptr = usbfs_open( "bulk.bin", "w" );
+    usbfs_write( l_bulk, BENCH_BULK_SIZE, l_fileptr );
+    usbfs_close( l_fileptr );
+    bench_record( &l_result, l_counters.busy_us, BENCH_BULK_SIZE );
+  }
+  free( l_bulk );
+  bench_report( "bulk", &l_result );
+
+  /* Copy that file in small pieces, so two files are in use at once. */
+  bench_stream( "bulk.bin", "copy.bin", l_iterations / 10 + 1 );
+
+  /* Then dip into it at random, following the FAT and then the link map. */
+  bench_seek( "seek", "bulk.bin", l_iterations * 10, false );
+  bench_seek( "fastseek", "bulk.bin", l_iterations * 10, true );
+
+  /* Leave the statistics for the whole run on the volume, for inspection. */
+  usbfs_dump_stats( "stats.csv" );
+
+  /* Make sure everything is safely in the image before we go. */
+  storage_flush();
+  return EXIT_SUCCESS;
+}
+
+
+/* End of file usbfs/host/bench.c */
@@ -0,0 +1,411 @@
+/*
+ * usbfs/host/flashio_host.c - part of the PicoW C/C++ Boilerplate Project
+ *
+ * A drop-in replacement for flashio.c, for building usbfs on a Linux host. The
+ * flash region is kept in an image file (named by the USBFS_FLASH_IMAGE
+ * environment variable, or "usbfs-flash.img" by default), and behaves like
+ * NOR flash: erasing sets a sector to 0xFF, and programming can only clear bits.
+ *
+ * Every operation is counted, and charged a modelled cost in time based on the
+ * typical figures for the W25Q16JV on the Pico W. Attempts to program a bit
+ * from 0 back to 1 (which real flash silently ignores) are counted as NOR
+ * violations; if USBFS_FLASH_STRICT is set in the environment, they abort the
+ * program instead. If USBFS_FLASH_REALTIME is set, each operation also sleeps
+ * for its modelled cost, so that wall clock timings are realistic. Setting
+ * USBFS_FLASH_BUSY to a number N makes every Nth erase or program fail, as
+ * they do on the Pico when the other core can't be parked in time, to check
+ * that the storage layers cope.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+/* System headers. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hardware/flash.h"
+
+
+/* Local headers. */
+
+#include "usbfs.h"
+#include "flashio_host.h"
+
+
+/* Constants. */
+
+#ifndef FLASHIO_HOST_IMAGE
+#define FLASHIO_HOST_IMAGE          "usbfs-flash.img"
+#endif
+#ifndef FLASHIO_HOST_ERASE_US
+#define FLASHIO_HOST_ERASE_US       45000   /* Typical 4kb sector erase */
+#endif
+#ifndef FLASHIO_HOST_BLOCK_ERASE_US
+#define FLASHIO_HOST_BLOCK_ERASE_US 150000  /* Typical 64kb block erase */
+#endif
+#ifndef FLASHIO_HOST_PROGRAM_US
+#define FLASHIO_HOST_PROGRAM_US     400     /* Typical 256 byte page program */
+#endif
+#ifndef FLASHIO_HOST_READ_KBPS
+#define FLASHIO_HOST_READ_KBPS      10000   /* Roughly, QSPI at 40MHz */
+#endif
+
+
+/* Module variables. */
+
+static uint32_t                 m_flash_size;
+static FILE                    *m_flash_file;
+static bool                     m_strict;
+static bool                     m_realtime;
+static uint32_t                 m_busy_every;
+static uint32_t                 m_busy_count;
+static flashio_host_counters_t  m_counters;
+
+
+/* Functions.*/
+
+/*
+ * fail - reports a problem with the image file; there's no sensible way to
+ *        carry on without our 'flash', so we give up.
+ */
+
+static void flashio_fail( const char *p_action )
+{
+  perror( p_action );
+  exit( EXIT_FAILURE );
+}
+
+
+/*
+ * charge - accounts for the modelled cost of an operation, and if we're running
+ *          in real time, waits for it too.
+ */
+
+static void flashio_charge( uint32_t p_cost_us )
+{
+  m_counters.busy_us += p_cost_us;
+  if ( m_realtime )
+  {
+    usleep( p_cost_us );
+  }
+  return;
+}
+
+
+/*
+ * busy - decides whether this erase or program should fail, as asked for by
+ *        USBFS_FLASH_BUSY.
+ */
+
+static bool flashio_busy( void )
+{
+  return ( m_busy_every > 0 ) && ( ++m_busy_count % m_busy_every == 0 );
+}
+
+
+/*
+ * init - opens (and if required, creates) the image file, making sure that
+ *        it's big enough for the requested region. The image only holds the
+ *        region itself, so the offset doesn't matter here.
+ */
+
+void flashio_init( uint32_t p_offset, uint32_t p_size_bytes )
+{
+  const char *l_filename, *l_busy;
+  long        l_length;
+  uint8_t     l_blank[FLASH_SECTOR_SIZE];
+
+  /* Check how we've been asked to behave. */
+  m_strict = ( getenv( "USBFS_FLASH_STRICT" ) != NULL );
+  m_realtime = ( getenv( "USBFS_FLASH_REALTIME" ) != NULL );
+  l_busy = getenv( "USBFS_FLASH_BUSY" );
+  m_busy_every = ( l_busy != NULL ) ? atoi( l_busy ) : 0;
+
+  /* Work out which file we're using, and open it up. */
+  l_filename = getenv( "USBFS_FLASH_IMAGE" );
+  if ( l_filename == NULL )
+  {
+    l_filename = FLASHIO_HOST_IMAGE;
+  }
+  m_flash_file = fopen( l_filename, "r+b" );
+  if ( m_flash_file == NULL )
+  {
+    m_flash_file = fopen( l_filename, "w+b" );
+  }
+  if ( m_flash_file == NULL )
+  {
+    flashio_fail( l_filename );
+  }
+
+  /* Any part of the region not already in the file starts off erased. */
+  m_flash_size = p_size_bytes;
+  memset( l_blank, 0xFF, FLASH_SECTOR_SIZE );
+  fseek( m_flash_file, 0, SEEK_END );
+  l_length = ftell( m_flash_file );
+  while ( l_length < (long)m_flash_size )
+  {
+    if ( fwrite( l_blank, 1, FLASH_SECTOR_SIZE, m_flash_file ) != FLASH_SECTOR_SIZE )
+    {
+      flashio_fail( "flashio_init" );
+    }
+    l_length += FLASH_SECTOR_SIZE;
+  }
+  fflush( m_flash_file );
+
+  /* All done. */
+  return;
+}
+
+
+/*
+ * get_free - returns the offset of the first free sector of flash; there's no
+ *            program binary to avoid on the host, so that's all of it.
+ */
+
+uint32_t flashio_get_free( void )
+{
+  return 0;
+}
+
+
+/*
+ * get_size - returns the size of our region of flash, in bytes.
+ */
+
+uint32_t flashio_get_size( void )
+{
+  return m_flash_size;
+}
+
+
+/*
+ * read - copies data out of the image file.
+ */
+
+void flashio_read( uint32_t p_address, void *p_buffer, uint32_t p_size_bytes )
+{
+  /* Find the right place, and read. */
+  if ( ( fseek( m_flash_file, p_address, SEEK_SET ) != 0 ) ||
+       ( fread( p_buffer, 1, p_size_bytes, m_flash_file ) != p_size_bytes ) )
+  {
+    flashio_fail( "flashio_read" );
+  }
+
+  /* Count it, and charge for it. */
+  m_counters.reads++;
+  m_counters.read_bytes += p_size_bytes;
+  stats_read( p_size_bytes );
+  flashio_charge( (uint64_t)p_size_bytes * 1000000 / ( FLASHIO_HOST_READ_KBPS * 1024 ) );
+
+  /* All done. */
+  return;
+}
+
+
+/*
+ * read_start - on the host, there's no DMA to speak of, so the read is simply
+ *              done straight away.
+ */
+
+bool flashio_read_start( uint32_t p_address, void *p_buffer, uint32_t p_size_bytes )
+{
+  flashio_read( p_address, p_buffer, p_size_bytes );
+  return true;
+}
+
+
+/*
+ * read_busy - as reads complete immediately, we are never busy.
+ */
+
+bool flashio_read_busy( void )
+{
+  return false;
+}
+
+
+/*
+ * read_cached - there's no XIP cache either, so this is just a normal read.
+ */
+
+void flashio_read_cached( uint32_t p_address, void *p_buffer, uint32_t p_size_bytes )
+{
+  flashio_read( p_address, p_buffer, p_size_bytes );
+  return;
+}
+
+
+/*
+ * erase - erases a single sector, setting it to 0xFF.
+ */
+
+bool flashio_erase( uint32_t p_address )
+{
+  uint8_t l_blank[FLASH_SECTOR_SIZE];
+
+  if ( flashio_busy() )
+  {
+    return false;
+  }
+
+  /* Just overwrite the sector with an erased one. */
+  memset( l_blank, 0xFF, FLASH_SECTOR_SIZE );
+  if ( ( fseek( m_flash_file, p_address, SEEK_SET ) != 0 ) ||
+       ( fwrite( l_blank, 1, FLASH_SECTOR_SIZE, m_flash_file ) != FLASH_SECTOR_SIZE ) )
+  {
+    flashio_fail( "flashio_erase" );
+  }
+
+  /* Count it, and charge for it. */
+  m_counters.erases++;
+  flashio_charge( FLASHIO_HOST_ERASE_US );
+  stats_erase( p_address, FLASH_SECTOR_SIZE, FLASHIO_HOST_ERASE_US );
+
+  /* All done. */
+  return true;
+}
+
+
+/*
+ * block_offset - returns how far into a 64kb erase block the given address
+ *                is; the image starts at the start of the region, and we
+ *                treat that as the start of a block.
+ */
+
+uint32_t flashio_block_offset( uint32_t p_address )
+{
+  return p_address % FLASH_BLOCK_SIZE;
+}
+
+
+/*
+ * erase_block - erases a whole, aligned 64kb block, setting it to 0xFF.
+ */
+
+bool flashio_erase_block( uint32_t p_address )
+{
+  uint8_t   l_blank[FLASH_SECTOR_SIZE];
+  uint32_t  l_done;
+
+  /* Like the real thing, only whole blocks can be erased like this. */
+  if ( p_address % FLASH_BLOCK_SIZE )
+  {
+    fprintf( stderr, "flashio_erase_block: unaligned erase at 0x%08x\n", p_address );
+    abort();
+  }
+  if ( flashio_busy() )
+  {
+    return false;
+  }
+
+  /* Overwrite each sector in the block with an erased one. */
+  memset( l_blank, 0xFF, FLASH_SECTOR_SIZE );
+  for ( l_done = 0; l_done < FLASH_BLOCK_SIZE; l_done += FLASH_SECTOR_SIZE )
+  {
+    if ( ( fseek( m_flash_file, p_address + l_done, SEEK_SET ) != 0 ) ||
+         ( fwrite( l_blank, 1, FLASH_SECTOR_SIZE, m_flash_file ) != FLASH_SECTOR_SIZE ) )
+    {
+      flashio_fail( "flashio_erase_block" );
+    }
+  }
+
+  /* Count it, and charge for it. */
+  m_counters.block_erases++;
+  flashio_charge( FLASHIO_HOST_BLOCK_ERASE_US );
+  stats_erase( p_address, FLASH_BLOCK_SIZE, FLASHIO_HOST_BLOCK_ERASE_US );
+
+  /* All done. */
+  return true;
+}
+
+
+/*
+ * program - writes data into flash; like the real thing, this can only clear
+ *           bits, so the data is ANDed with the current contents.
+ */
+
+bool flashio_program( uint32_t p_address, const void *p_buffer, uint32_t p_size_bytes )
+{
+  uint8_t   l_page[FLASH_PAGE_SIZE];
+  uint8_t   l_data;
+  uint32_t  l_done, l_index;
+
+  /* Like the real thing, we work in whole, aligned pages. */
+  if ( ( p_address % FLASH_PAGE_SIZE ) || ( p_size_bytes % FLASH_PAGE_SIZE ) )
+  {
+    fprintf( stderr, "flashio_program: unaligned program at 0x%08x\n", p_address );
+    abort();
+  }
+  if ( flashio_busy() )
+  {
+    return false;
+  }
+
+  /* Work a page at a time. */
+  for ( l_done = 0; l_done < p_size_bytes; l_done += FLASH_PAGE_SIZE )
+  {
+    /* Programming can only ever clear bits; anything else is a violation. */
+    fseek( m_flash_file, p_address + l_done, SEEK_SET );
+    if ( fread( l_page, 1, FLASH_PAGE_SIZE, m_flash_file ) != FLASH_PAGE_SIZE )
+    {
+      flashio_fail( "flashio_program" );
+    }
+    for ( l_index = 0; l_index < FLASH_PAGE_SIZE; l_index++ )
+    {
+      l_data = ((const uint8_t *)p_buffer)[l_done + l_index];
+      if ( l_data & ~l_page[l_index] )
+      {
+        m_counters.violations++;
+        if ( m_strict )
+        {
+          fprintf( stderr, "flashio_program: NOR violation at 0x%08x\n", p_address + l_done + l_index );
+          abort();
+        }
+      }
+      l_page[l_index] &= l_data;
+    }
+    if ( ( fseek( m_flash_file, p_address + l_done, SEEK_SET ) != 0 ) ||
+         ( fwrite( l_page, 1, FLASH_PAGE_SIZE, m_flash_file ) != FLASH_PAGE_SIZE ) )
+    {
+      flashio_fail( "flashio_program" );
+    }
+
+    /* Count it, and charge for it. */
+    m_counters.programs++;
+    m_counters.program_bytes += FLASH_PAGE_SIZE;
+    flashio_charge( FLASHIO_HOST_PROGRAM_US );
+  }
+  stats_program( p_size_bytes, FLASHIO_HOST_PROGRAM_US * p_size_bytes / FLASH_PAGE_SIZE );
+
+  /* All done. */
+  return true;
+}
+
+
+/*
+ * host_get_counters - fetches a copy of the operation counters.
+ */
+
+void flashio_host_get_counters( flashio_host_counters_t *p_counters )
+{
+  *p_counters = m_counters;
+  return;
+}
+
+
+/*
+ * host_reset_counters - zeroes all the operation counters.
+ */
+
+void flashio_host_reset_counters( void )
+{
+  memset( &m_counters, 0, sizeof( flashio_host_counters_t ) );
+  return;
+}
+
+
+/* End of file usbfs/host/flashio_host.c */
@@ -0,0 +1,45 @@
+/*
+ * usbfs/host/flashio_host.h - part of the PicoW C/C++ Boilerplate Project
+ *
+ * Extra functions provided by the host flash emulator (flashio_host.c), to let
+ * host-side tools see what the storage layers have been asking of the flash.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+
+/* Structures */
+
+typedef struct
+{
+  uint32_t  reads;
+  uint64_t  read_bytes;
+  uint32_t  erases;
+  uint32_t  block_erases;
+  uint32_t  programs;
+  uint64_t  program_bytes;
+  uint32_t  violations;
+  uint64_t  busy_us;
+} flashio_host_counters_t;
+
+
+/* Function prototypes. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void  flashio_host_get_counters( flashio_host_counters_t * );
+void  flashio_host_reset_counters( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+
+/* End of file usbfs/host/flashio_host.h */
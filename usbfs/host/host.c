@@ -0,0 +1,275 @@
+/*
+ * usbfs/host/host.c - part of the PicoW C/C++ Boilerplate Project
+ *
+ * Stand-ins for the handful of Pico SDK and USB functions that usbfs relies
+ * on, so that it can be built and exercised on a Linux host. Time is taken
+ * from the host's monotonic clock, although tools can move it on artificially
+ * with host_advance_time_us(), rather than waiting.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+/* System headers. */
+
+#include <time.h>
+
+#include "pico/stdlib.h"
+
+
+/* Local headers. */
+
+#include "usbfs.h"
+#include "host.h"
+
+
+/* Module variables. */
+
+static uint64_t m_time_offset_us;
+
+
+/* Functions.*/
+
+/*
+ * advance_time_us - moves the clock on by the given number of microseconds, so
+ *                   that timeouts can be reached without waiting for them.
+ */
+
+void host_advance_time_us( uint64_t p_microseconds )
+{
+  m_time_offset_us += p_microseconds;
+  return;
+}
+
+
+/*
+ * time_us_64 - returns the number of microseconds since some arbitrary point.
+ */
+
+uint64_t time_us_64( void )
+{
+  struct timespec l_now;
+
+  clock_gettime( CLOCK_MONOTONIC, &l_now );
+  return (uint64_t)l_now.tv_sec * 1000000 + l_now.tv_nsec / 1000 + m_time_offset_us;
+}
+
+
+/*
+ * time_us_32 - the same, but truncated to 32 bits like the Pico timer.
+ */
+
+uint32_t time_us_32( void )
+{
+  return (uint32_t)time_us_64();
+}
+
+
+/*
+ * get_absolute_time - returns the current time.
+ */
+
+absolute_time_t get_absolute_time( void )
+{
+  return time_us_64();
+}
+
+
+/*
+ * make_timeout_time_ms - returns the time a given number of milliseconds from now.
+ */
+
+absolute_time_t make_timeout_time_ms( uint32_t p_milliseconds )
+{
+  return time_us_64() + (uint64_t)p_milliseconds * 1000;
+}
+
+
+/*
+ * time_reached - returns true if the given time has passed.
+ */
+
+bool time_reached( absolute_time_t p_time )
+{
+  return time_us_64() >= p_time;
+}
+
+
+/*
+ * absolute_time_diff_us - returns the microseconds from one time to another.
+ */
+
+int64_t absolute_time_diff_us( absolute_time_t p_from, absolute_time_t p_to )
+{
+  return (int64_t)( p_to - p_from );
+}
+
+
+/*
+ * absolute_time_min - returns the earlier of two times.
+ */
+
+absolute_time_t absolute_time_min( absolute_time_t p_a, absolute_time_t p_b )
+{
+  return ( p_a < p_b ) ? p_a : p_b;
+}
+
+
+/*
+ * sleep_ms - sleeps for the given number of milliseconds.
+ */
+
+void sleep_ms( uint32_t p_milliseconds )
+{
+  struct timespec l_delay;
+
+  l_delay.tv_sec = p_milliseconds / 1000;
+  l_delay.tv_nsec = ( p_milliseconds % 1000 ) * 1000000;
+  nanosleep( &l_delay, NULL );
+  return;
+}
+
+
+/*
+ * best_effort_wfe_or_timeout - there are no events to wait for on a host, so
+ *                              this just sleeps until the timeout; never for
+ *                              more than a second though, as the end of time
+ *                              is a while to wait.
+ */
+
+bool best_effort_wfe_or_timeout( absolute_time_t p_timeout )
+{
+  struct timespec l_delay;
+  int64_t         l_wait_us;
+
+  /* Work out how long to wait, if at all. */
+  l_wait_us = absolute_time_diff_us( time_us_64(), p_timeout );
+  if ( l_wait_us <= 0 )
+  {
+    return true;
+  }
+  if ( l_wait_us > 1000000 )
+  {
+    l_wait_us = 1000000;
+  }
+
+  /* And sleep. */
+  l_delay.tv_sec = l_wait_us / 1000000;
+  l_delay.tv_nsec = ( l_wait_us % 1000000 ) * 1000;
+  nanosleep( &l_delay, NULL );
+  return time_reached( p_timeout );
+}
+
+
+/*
+ * usb_init - there's no USB host, so no record of what it has seen is needed.
+ */
+
+void usb_init( void )
+{
+  return;
+}
+
+
+/*
+ * usb_note_local_write - there's no USB host caching anything, so nothing to do.
+ */
+
+void usb_note_local_write( uint8_t p_lun, uint32_t p_lba, uint32_t p_count )
+{
+  return;
+}
+
+
+/*
+ * usb_host_writes - there's no USB host, so it never writes anything.
+ */
+
+uint32_t usb_host_writes( uint8_t p_lun )
+{
+  return 0;
+}
+
+
+/*
+ * usb_watch_clear - there's no USB host to write anything, so there's nothing
+ *                   to watch for.
+ */
+
+void usb_watch_clear( uint8_t p_lun )
+{
+  return;
+}
+
+
+/*
+ * usb_watch_blocks - so there's no need to note what's being watched...
+ */
+
+void usb_watch_blocks( uint8_t p_lun, uint32_t p_lba, uint32_t p_count )
+{
+  return;
+}
+
+
+/*
+ * usb_watch_triggered - ...and a watch is never triggered.
+ */
+
+bool usb_watch_triggered( uint8_t p_lun )
+{
+  return false;
+}
+
+
+/*
+ * usb_watch_next_update - nor does one ever need checking.
+ */
+
+absolute_time_t usb_watch_next_update( void )
+{
+  return at_the_end_of_time;
+}
+
+
+/*
+ * usb_set_fs_changed - there's no USB host to tell, so nothing to do.
+ */
+
+void usb_set_fs_changed( void )
+{
+  return;
+}
+
+
+/*
+ * usb_trace_get - there's no USB host to record, so there's never a record.
+ */
+
+bool usb_trace_get( uint32_t p_index, usb_trace_t *p_record )
+{
+  return false;
+}
+
+
+/*
+ * usb_trace_dropped - and nothing is ever dropped.
+ */
+
+uint32_t usb_trace_dropped( void )
+{
+  return 0;
+}
+
+
+/*
+ * usb_trace_reset - nor is there anything to reset.
+ */
+
+void usb_trace_reset( void )
+{
+  return;
+}
+
+
+/* End of file usbfs/host/host.c */
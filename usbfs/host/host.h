@@ -0,0 +1,29 @@
+/*
+ * usbfs/host/host.h - part of the PicoW C/C++ Boilerplate Project
+ *
+ * Extra functions provided by the host stand-ins (host.c), for host-side tools
+ * which need to control the passing of time.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+
+/* Function prototypes. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void  host_advance_time_us( uint64_t );
+
+#ifdef __cplusplus
+}
+#endif
+
+
+/* End of file usbfs/host/host.h */
@@ -0,0 +1,24 @@
+/*
+ * usbfs/host/include/hardware/flash.h - part of the PicoW C/C++ Boilerplate Project
+ *
+ * A minimal stand-in for the Pico SDK header; the geometry matches the flash
+ * on the Pico W, which is what flashio_host.c emulates.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+#pragma once
+
+#include "pico/stdlib.h"
+
+
+/* Constants. */
+
+#define FLASH_PAGE_SIZE         (1u << 8)
+#define FLASH_SECTOR_SIZE       (1u << 12)
+#define FLASH_BLOCK_SIZE        (1u << 16)
+#define PICO_FLASH_SIZE_BYTES   (2 * 1024 * 1024)
+
+
+/* End of file usbfs/host/include/hardware/flash.h */
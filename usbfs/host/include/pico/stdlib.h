@@ -0,0 +1,50 @@
+/*
+ * usbfs/host/include/pico/stdlib.h - part of the PicoW C/C++ Boilerplate Project
+ *
+ * A minimal stand-in for the Pico SDK header, providing just enough of the
+ * types and timing functions for usbfs (and opt/config.c) to build on a host.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Structures */
+
+typedef uint64_t absolute_time_t;
+
+
+/* Constants. */
+
+#define at_the_end_of_time  ((absolute_time_t)INT64_MAX)
+
+
+/* Function prototypes. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint64_t        time_us_64( void );
+uint32_t        time_us_32( void );
+absolute_time_t get_absolute_time( void );
+absolute_time_t make_timeout_time_ms( uint32_t );
+bool            time_reached( absolute_time_t );
+absolute_time_t absolute_time_min( absolute_time_t, absolute_time_t );
+int64_t         absolute_time_diff_us( absolute_time_t, absolute_time_t );
+void            sleep_ms( uint32_t );
+bool            best_effort_wfe_or_timeout( absolute_time_t );
+
+#ifdef __cplusplus
+}
+#endif
+
+
+/* End of file usbfs/host/include/pico/stdlib.h */
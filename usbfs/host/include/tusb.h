@@ -0,0 +1,23 @@
+/*
+ * usbfs/host/include/tusb.h - part of the PicoW C/C++ Boilerplate Project
+ *
+ * A stand-in for TinyUSB; there is no USB host to talk to when running on a
+ * Linux host, so these do nothing at all.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+#pragma once
+
+#include "pico/stdlib.h"
+
+
+/* Functions. */
+
+static inline bool tusb_init( void ) { return true; }
+static inline void tud_task( void ) { }
+static inline bool tud_task_event_ready( void ) { return false; }
+
+
+/* End of file usbfs/host/include/tusb.h */
@@ -0,0 +1,294 @@
+/*
+ * usbfs/host/replay.c - part of the PicoW C/C++ Boilerplate Project
+ *
+ * Plays back traces of the transfers made by a real USB host, as recorded on
+ * the device by usbfs_dump_trace(), against the storage layer and the flash
+ * emulator in flashio_host.c. Each transfer is fed to the storage layer in the
+ * same endpoint-sized pieces that TinyUSB would use, and the pauses between
+ * them are reproduced (without actually waiting) so that idle flushes happen
+ * as they would on the device. For each trace, the flash operations caused,
+ * the write amplification and the modelled flash time are reported; this gives
+ * repeatable figures for any change to the storage or caching layers.
+ *
+ * Usage: usbfs_replay trace.csv [trace.csv ...]
+ *
+ * The traces are played one after the other onto the same volume. Unless the
+ * USBFS_FLASH_IMAGE environment variable names an image to use, the replay
+ * starts from a freshly formatted one each time.
+ *
+ * The trace doesn't capture the data the host wrote, so every write is filled
+ * with fresh random data; this is the worst case for compare-before-commit, as
+ * nothing written ever matches what's already in flash.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+/* System headers. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+
+/* Local headers. */
+
+#include "usbfs.h"
+#include "flashio_host.h"
+#include "host.h"
+
+
+/* Constants. */
+
+#define REPLAY_IMAGE        "usbfs-replay.img"
+#define REPLAY_CHUNK        512     /* TinyUSB's MSC endpoint buffer size */
+#define REPLAY_STALL        100000  /* Busy replies in a row before we call it a hang */
+
+
+/* Structures. */
+
+typedef struct
+{
+  uint32_t  commands;
+  uint64_t  read_bytes;
+  uint64_t  written_bytes;
+} replay_result_t;
+
+
+/* Functions.*/
+
+/*
+ * settle - keeps the storage layer moving until it has nothing left to do for
+ *          now, as the device's main loop would while the host is quiet.
+ */
+
+static void replay_settle( void )
+{
+  while( time_reached( storage_next_update() ) )
+  {
+    storage_update();
+  }
+  return;
+}
+
+
+/*
+ * idle - lets the given number of milliseconds pass, finishing off any work
+ *        in progress and allowing any idle flush to happen.
+ */
+
+static void replay_idle( uint32_t p_milliseconds )
+{
+  replay_settle();
+  host_advance_time_us( (uint64_t)p_milliseconds * 1000 );
+  replay_settle();
+  return;
+}
+
+
+/*
+ * transfer - plays back a single read or write, a buffer at a time; when the
+ *            storage layer isn't ready, it is simply asked again, just as
+ *            TinyUSB would do, without storage_update() getting a look in. If
+ *            it never becomes ready, the device would have hung.
+ */
+
+static bool replay_transfer( char p_op, uint8_t p_lun, uint32_t p_lba,
+                             uint32_t p_offset, uint32_t p_length )
+{
+  uint8_t   l_buffer[REPLAY_CHUNK];
+  uint32_t  l_done, l_chunk, l_index, l_busy = 0;
+  int32_t   l_bytecount;
+
+  for ( l_done = 0; l_done < p_length; l_done += l_bytecount )
+  {
+    /* TinyUSB works through the transfer a block at a time. */
+    l_chunk = p_length - l_done;
+    if ( l_chunk > REPLAY_CHUNK )
+    {
+      l_chunk = REPLAY_CHUNK;
+    }
+    if ( p_op == 'W' )
+    {
+      for ( l_index = 0; l_index < l_chunk; l_index++ )
+      {
+        l_buffer[l_index] = rand();
+      }
+      l_bytecount = storage_write( p_lun, p_lba, p_offset + l_done, l_buffer, l_chunk );
+    }
+    else
+    {
+      l_bytecount = storage_read_async( p_lun, p_lba, p_offset + l_done, l_buffer, l_chunk );
+    }
+
+    /* Errors are fatal, while zero means try again; but not forever. */
+    if ( l_bytecount < 0 )
+    {
+      return false;
+    }
+    if ( l_bytecount > 0 )
+    {
+      l_busy = 0;
+    }
+    else if ( ++l_busy >= REPLAY_STALL )
+    {
+      fprintf( stderr, "transfer to block %u stalled\n", p_lba );
+      return false;
+    }
+  }
+
+  /* All done. */
+  return true;
+}
+
+
+/*
+ * file - plays back a single trace file, adding up what it did.
+ */
+
+static bool replay_file( const char *p_pathname, replay_result_t *p_result )
+{
+  FILE     *l_file;
+  char      l_line[128];
+  char      l_op;
+  uint32_t  l_value, l_time, l_last_time = 0, l_lun, l_lba, l_offset, l_length;
+  bool      l_started = false;
+
+  /* Open up the trace. */
+  l_file = fopen( p_pathname, "r" );
+  if ( l_file == NULL )
+  {
+    perror( p_pathname );
+    return false;
+  }
+
+  /* And work through it a line at a time. */
+  while( fgets( l_line, sizeof( l_line ), l_file ) != NULL )
+  {
+    /* The header lines first; the block size must match ours. */
+    if ( sscanf( l_line, "block_size,%u", &l_value ) == 1 )
+    {
+      if ( l_value != USBFS_BLOCK_SIZE )
+      {
+        fprintf( stderr, "%s: recorded with %u byte blocks, but built for %u\n",
+                 p_pathname, l_value, USBFS_BLOCK_SIZE );
+        fclose( l_file );
+        return false;
+      }
+      continue;
+    }
+    if ( sscanf( l_line, "dropped,%u", &l_value ) == 1 )
+    {
+      if ( l_value > 0 )
+      {
+        fprintf( stderr, "%s: %u transfers were not recorded\n", p_pathname, l_value );
+      }
+      continue;
+    }
+
+    /* Then the transfers themselves. */
+    if ( sscanf( l_line, "%c,%u,%u,%u,%u,%u",
+                 &l_op, &l_time, &l_lun, &l_lba, &l_offset, &l_length ) != 6 )
+    {
+      continue;
+    }
+
+    /* Let the same time pass as did on the device. */
+    if ( l_started && ( l_time > l_last_time ) )
+    {
+      replay_idle( l_time - l_last_time );
+    }
+    l_last_time = l_time;
+    l_started = true;
+
+    /* And then do what the host did. */
+    p_result->commands++;
+    switch( l_op )
+    {
+      case 'R':
+      case 'W':
+        if ( !replay_transfer( l_op, l_lun, l_lba, l_offset, l_length ) )
+        {
+          fprintf( stderr, "%s: transfer to block %u failed\n", p_pathname, l_lba );
+          fclose( l_file );
+          return false;
+        }
+        if ( l_op == 'R' )
+        {
+          p_result->read_bytes += l_length;
+        }
+        else
+        {
+          p_result->written_bytes += l_length;
+        }
+        break;
+
+      case 'S':
+        storage_flush();
+        break;
+    }
+  }
+
+  /* The host would eject the drive when it was done, flushing everything. */
+  fclose( l_file );
+  replay_settle();
+  storage_flush();
+  return true;
+}
+
+
+/*
+ * main - replays each of the traces in turn.
+ */
+
+int main( int argc, char **argv )
+{
+  flashio_host_counters_t l_counters;
+  replay_result_t         l_result;
+  int                     l_index;
+
+  /* We need at least one trace to work with. */
+  if ( argc < 2 )
+  {
+    fprintf( stderr, "Usage: %s trace.csv [trace.csv ...]\n", argv[0] );
+    return EXIT_FAILURE;
+  }
+
+  /* Start from a fresh image, unless we've been given one. */
+  if ( getenv( "USBFS_FLASH_IMAGE" ) == NULL )
+  {
+    remove( REPLAY_IMAGE );
+    setenv( "USBFS_FLASH_IMAGE", REPLAY_IMAGE, 1 );
+  }
+  usbfs_init();
+  storage_flush();
+
+  /* Play back each trace, reporting as we go. */
+  for ( l_index = 1; l_index < argc; l_index++ )
+  {
+    memset( &l_result, 0, sizeof( replay_result_t ) );
+    flashio_host_reset_counters();
+    if ( !replay_file( argv[l_index], &l_result ) )
+    {
+      return EXIT_FAILURE;
+    }
+
+    flashio_host_get_counters( &l_counters );
+    printf( "%-20s %6u cmds %9llu read %9llu written | %6u erases %4u blocks %7u pages "
+            "%9llu programmed | WA %6.2f | flash %9.2fms\n",
+            argv[l_index], l_result.commands,
+            (unsigned long long)l_result.read_bytes, (unsigned long long)l_result.written_bytes,
+            l_counters.erases, l_counters.block_erases, l_counters.programs,
+            (unsigned long long)l_counters.program_bytes,
+            l_result.written_bytes ? (double)l_counters.program_bytes / l_result.written_bytes : 0.0,
+            l_counters.busy_us / 1000.0 );
+  }
+
+  /* All done. */
+  return EXIT_SUCCESS;
+}
+
+
+/* End of file usbfs/host/replay.c */
@@ -0,0 +1,462 @@
+/*
+ * usbfs/host/sync_tool.c - part of the PicoW C/C++ Boilerplate Project
+ *
+ * A Linux command line tool for the optional vendor-class file-sync interface
+ * (see usbfs/sync.c, and sync.h for the protocol); it talks to the device
+ * directly through libusb, so files can be copied on and off without the host
+ * mounting the MSC volume at all.
+ *
+ * Usage: usbfs_sync ls [directory]
+ *        usbfs_sync get remote [local]
+ *        usbfs_sync put local [remote]
+ *        usbfs_sync rm remote
+ *
+ * Without a udev rule granting access to the device, this will need to be run
+ * as root.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+/* System headers. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+
+/* Local headers. */
+
+#include "sync.h"
+
+
+/* Constants. */
+
+#define SYNC_VENDOR_ID      0xCafe  /* USB_VENDOR_ID, in usbfs.h */
+#define SYNC_CLASS_VENDOR   0xFF
+#define SYNC_TIMEOUT_MS     5000
+#define SYNC_CHUNK          4096
+#define SYNC_DRAIN_MS       100     /* How long to wait for stale data on opening */
+
+
+/* Structures. */
+
+typedef struct
+{
+  libusb_device_handle *handle;
+  uint8_t               interface;
+  uint8_t               ep_in;
+  uint8_t               ep_out;
+  uint16_t              packet_size;
+} sync_device_t;
+
+
+/* Functions.*/
+
+/*
+ * find_interface - looks through a device's configuration for our vendor-class
+ *                  interface, filling in the endpoints if it finds one.
+ */
+
+static bool sync_find_interface( libusb_device *p_device, sync_device_t *p_sync )
+{
+  struct libusb_config_descriptor           *l_config;
+  const struct libusb_interface_descriptor  *l_itf;
+  uint_fast8_t                               l_index, l_ep;
+  bool                                       l_found = false;
+
+  if ( libusb_get_active_config_descriptor( p_device, &l_config ) != 0 )
+  {
+    return false;
+  }
+
+  for ( l_index = 0; !l_found && l_index < l_config->bNumInterfaces; l_index++ )
+  {
+    l_itf = &l_config->interface[l_index].altsetting[0];
+    if ( l_itf->bInterfaceClass != SYNC_CLASS_VENDOR )
+    {
+      continue;
+    }
+
+    /* It should have one bulk endpoint in each direction. */
+    p_sync->interface = l_itf->bInterfaceNumber;
+    p_sync->ep_in = p_sync->ep_out = 0;
+    for ( l_ep = 0; l_ep < l_itf->bNumEndpoints; l_ep++ )
+    {
+      if ( l_itf->endpoint[l_ep].bEndpointAddress & LIBUSB_ENDPOINT_IN )
+      {
+        p_sync->ep_in = l_itf->endpoint[l_ep].bEndpointAddress;
+        p_sync->packet_size = l_itf->endpoint[l_ep].wMaxPacketSize;
+      }
+      else
+      {
+        p_sync->ep_out = l_itf->endpoint[l_ep].bEndpointAddress;
+      }
+    }
+    l_found = ( p_sync->ep_in != 0 ) && ( p_sync->ep_out != 0 );
+  }
+
+  libusb_free_config_descriptor( l_config );
+  return l_found;
+}
+
+
+/*
+ * open - finds the first attached device offering the file-sync interface,
+ *        and claims that interface.
+ */
+
+static bool sync_open( sync_device_t *p_sync )
+{
+  libusb_device                   **l_list;
+  struct libusb_device_descriptor   l_desc;
+  ssize_t                           l_count, l_index;
+  uint8_t                           l_stale[SYNC_CHUNK];
+  int                               l_received;
+
+  p_sync->handle = NULL;
+  l_count = libusb_get_device_list( NULL, &l_list );
+  for ( l_index = 0; l_index < l_count && p_sync->handle == NULL; l_index++ )
+  {
+    if ( ( libusb_get_device_descriptor( l_list[l_index], &l_desc ) != 0 ) ||
+         ( l_desc.idVendor != SYNC_VENDOR_ID ) ||
+         !sync_find_interface( l_list[l_index], p_sync ) )
+    {
+      continue;
+    }
+    if ( libusb_open( l_list[l_index], &p_sync->handle ) != 0 )
+    {
+      p_sync->handle = NULL;
+    }
+  }
+  libusb_free_device_list( l_list, 1 );
+
+  if ( p_sync->handle == NULL )
+  {
+    fprintf( stderr, "No usbfs device with a sync interface found\n" );
+    return false;
+  }
+  if ( libusb_claim_interface( p_sync->handle, p_sync->interface ) != 0 )
+  {
+    fprintf( stderr, "Unable to claim the sync interface\n" );
+    libusb_close( p_sync->handle );
+    return false;
+  }
+
+  /* If an earlier run gave up part way through a reply, throw the rest away. */
+  while( ( libusb_bulk_transfer( p_sync->handle, p_sync->ep_in, l_stale, sizeof( l_stale ),
+                                 &l_received, SYNC_DRAIN_MS ) == 0 ) && ( l_received > 0 ) );
+  return true;
+}
+
+
+/*
+ * send - writes a buffer to the device, in full.
+ */
+
+static bool sync_send( sync_device_t *p_sync, const void *p_buffer, uint32_t p_length )
+{
+  int l_sent;
+
+  while( p_length > 0 )
+  {
+    if ( libusb_bulk_transfer( p_sync->handle, p_sync->ep_out, (uint8_t *)p_buffer,
+                               p_length, &l_sent, SYNC_TIMEOUT_MS ) != 0 )
+    {
+      return false;
+    }
+    p_buffer = (const uint8_t *)p_buffer + l_sent;
+    p_length -= l_sent;
+  }
+  return true;
+}
+
+
+/*
+ * receive - reads exactly the requested number of bytes from the device; we
+ *           ask for whole packets, so anything extra is kept for next time.
+ *           We never ask for more packets than are needed, as the device
+ *           doesn't end its replies with a short packet.
+ */
+
+static bool sync_receive( sync_device_t *p_sync, void *p_buffer, uint32_t p_length )
+{
+  static uint8_t  l_spare[SYNC_CHUNK];
+  static uint32_t l_spare_start, l_spare_end;
+  uint32_t        l_length;
+  int             l_received;
+
+  while( p_length > 0 )
+  {
+    /* Use up anything left over from the last transfer first. */
+    if ( l_spare_start < l_spare_end )
+    {
+      l_length = l_spare_end - l_spare_start;
+      if ( l_length > p_length )
+      {
+        l_length = p_length;
+      }
+      memcpy( p_buffer, l_spare + l_spare_start, l_length );
+      l_spare_start += l_length;
+      p_buffer = (uint8_t *)p_buffer + l_length;
+      p_length -= l_length;
+      continue;
+    }
+
+    /* Then fetch some more. */
+    l_length = ( p_length + p_sync->packet_size - 1 ) / p_sync->packet_size * p_sync->packet_size;
+    if ( l_length > sizeof( l_spare ) )
+    {
+      l_length = sizeof( l_spare );
+    }
+    if ( libusb_bulk_transfer( p_sync->handle, p_sync->ep_in, l_spare, l_length,
+                               &l_received, SYNC_TIMEOUT_MS ) != 0 )
+    {
+      return false;
+    }
+    l_spare_start = 0;
+    l_spare_end = l_received;
+  }
+  return true;
+}
+
+
+/*
+ * request - sends a request to the device, and waits for its reply header;
+ *           returns the length of any data to follow, or -1 on failure.
+ */
+
+static int64_t sync_request( sync_device_t *p_sync, uint8_t p_command, const char *p_name,
+                             uint32_t p_data_length, FILE *p_data )
+{
+  sync_header_t l_header;
+  uint8_t       l_buffer[SYNC_CHUNK];
+  size_t        l_length;
+
+  /* The header, then the name. */
+  memset( &l_header, 0, sizeof( l_header ) );
+  l_header.magic = SYNC_MAGIC;
+  l_header.command = p_command;
+  l_header.name_length = strlen( p_name );
+  l_header.data_length = p_data_length;
+  if ( !sync_send( p_sync, &l_header, sizeof( l_header ) ) ||
+       !sync_send( p_sync, p_name, l_header.name_length ) )
+  {
+    fprintf( stderr, "Failed to send request\n" );
+    return -1;
+  }
+
+  /* Then any data, straight from the file. */
+  while( p_data_length > 0 )
+  {
+    l_length = fread( l_buffer, 1, sizeof( l_buffer ), p_data );
+    if ( l_length == 0 )
+    {
+      /* The file has shrunk under us; the device still expects the rest. */
+      memset( l_buffer, 0, sizeof( l_buffer ) );
+      l_length = sizeof( l_buffer );
+    }
+    if ( l_length > p_data_length )
+    {
+      l_length = p_data_length;
+    }
+    if ( !sync_send( p_sync, l_buffer, l_length ) )
+    {
+      fprintf( stderr, "Failed to send data\n" );
+      return -1;
+    }
+    p_data_length -= l_length;
+  }
+
+  /* And see what the device made of it. */
+  if ( !sync_receive( p_sync, &l_header, sizeof( l_header ) ) ||
+       ( l_header.magic != SYNC_MAGIC ) )
+  {
+    fprintf( stderr, "No valid reply from the device\n" );
+    return -1;
+  }
+  if ( l_header.status != SYNC_STATUS_OK )
+  {
+    fprintf( stderr, "%s: failed with status %u\n", p_name, l_header.status );
+    return -1;
+  }
+  return l_header.data_length;
+}
+
+
+/*
+ * list - lists the contents of a directory on the device.
+ */
+
+static bool sync_list( sync_device_t *p_sync, const char *p_directory )
+{
+  sync_entry_t  l_entry;
+  char          l_name[SYNC_MAX_NAME+1];
+  int64_t       l_remaining;
+
+  l_remaining = sync_request( p_sync, SYNC_CMD_LIST, p_directory, 0, NULL );
+  while( l_remaining > 0 )
+  {
+    if ( !sync_receive( p_sync, &l_entry, sizeof( l_entry ) ) ||
+         !sync_receive( p_sync, l_name, l_entry.name_length ) )
+    {
+      return false;
+    }
+    l_name[l_entry.name_length] = '\0';
+    l_remaining -= sizeof( l_entry ) + l_entry.name_length;
+
+    /* The timestamp is in FatFS (DOS) form; date in the top half. */
+    printf( "%10u  %04u-%02u-%02u %02u:%02u  %s%s\n",
+            l_entry.size,
+            ( l_entry.timestamp >> 25 ) + 1980, ( l_entry.timestamp >> 21 ) & 0x0F,
+            ( l_entry.timestamp >> 16 ) & 0x1F, ( l_entry.timestamp >> 11 ) & 0x1F,
+            ( l_entry.timestamp >> 5 ) & 0x3F,
+            l_name, ( l_entry.attributes & 0x10 ) ? "/" : "" );
+  }
+  return l_remaining == 0;
+}
+
+
+/*
+ * get - copies a file from the device.
+ */
+
+static bool sync_get( sync_device_t *p_sync, const char *p_remote, const char *p_local )
+{
+  FILE     *l_file;
+  uint8_t   l_buffer[SYNC_CHUNK];
+  int64_t   l_remaining;
+  uint32_t  l_length;
+
+  l_file = fopen( p_local, "wb" );
+  if ( l_file == NULL )
+  {
+    perror( p_local );
+    return false;
+  }
+
+  l_remaining = sync_request( p_sync, SYNC_CMD_READ, p_remote, 0, NULL );
+  while( l_remaining > 0 )
+  {
+    l_length = ( l_remaining < SYNC_CHUNK ) ? l_remaining : SYNC_CHUNK;
+    if ( !sync_receive( p_sync, l_buffer, l_length ) )
+    {
+      break;
+    }
+    fwrite( l_buffer, 1, l_length, l_file );
+    l_remaining -= l_length;
+  }
+
+  /* Don't leave a partial copy lying around. */
+  fclose( l_file );
+  if ( l_remaining != 0 )
+  {
+    remove( p_local );
+    return false;
+  }
+  return true;
+}
+
+
+/*
+ * put - copies a file to the device.
+ */
+
+static bool sync_put( sync_device_t *p_sync, const char *p_local, const char *p_remote )
+{
+  FILE *l_file;
+  long  l_size;
+  bool  l_result;
+
+  l_file = fopen( p_local, "rb" );
+  if ( l_file == NULL )
+  {
+    perror( p_local );
+    return false;
+  }
+  fseek( l_file, 0, SEEK_END );
+  l_size = ftell( l_file );
+  rewind( l_file );
+
+  l_result = sync_request( p_sync, SYNC_CMD_WRITE, p_remote, l_size, l_file ) == 0;
+  fclose( l_file );
+  return l_result;
+}
+
+
+/*
+ * basename - finds the last element of a pathname, to use when the other
+ *            side's name isn't given.
+ */
+
+static const char *sync_basename( const char *p_pathname )
+{
+  const char *l_slash = strrchr( p_pathname, '/' );
+  return ( l_slash == NULL ) ? p_pathname : l_slash + 1;
+}
+
+
+/*
+ * main - works out what we've been asked to do, and does it.
+ */
+
+int main( int argc, char **argv )
+{
+  sync_device_t l_sync;
+  bool          l_result = false;
+
+  if ( argc < 2 )
+  {
+    fprintf( stderr, "Usage: %s ls [directory]\n"
+                     "       %s get remote [local]\n"
+                     "       %s put local [remote]\n"
+                     "       %s rm remote\n", argv[0], argv[0], argv[0], argv[0] );
+    return EXIT_FAILURE;
+  }
+
+  /* Find the device. */
+  if ( libusb_init( NULL ) != 0 )
+  {
+    fprintf( stderr, "Unable to initialise libusb\n" );
+    return EXIT_FAILURE;
+  }
+  if ( !sync_open( &l_sync ) )
+  {
+    libusb_exit( NULL );
+    return EXIT_FAILURE;
+  }
+
+  /* And do the work. */
+  if ( strcmp( argv[1], "ls" ) == 0 )
+  {
+    l_result = sync_list( &l_sync, ( argc > 2 ) ? argv[2] : "/" );
+  }
+  else if ( strcmp( argv[1], "get" ) == 0 && argc > 2 )
+  {
+    l_result = sync_get( &l_sync, argv[2], ( argc > 3 ) ? argv[3] : sync_basename( argv[2] ) );
+  }
+  else if ( strcmp( argv[1], "put" ) == 0 && argc > 2 )
+  {
+    l_result = sync_put( &l_sync, argv[2], ( argc > 3 ) ? argv[3] : sync_basename( argv[2] ) );
+  }
+  else if ( strcmp( argv[1], "rm" ) == 0 && argc > 2 )
+  {
+    l_result = sync_request( &l_sync, SYNC_CMD_DELETE, argv[2], 0, NULL ) == 0;
+  }
+  else
+  {
+    fprintf( stderr, "%s: unknown command %s\n", argv[0], argv[1] );
+  }
+
+  /* All done. */
+  libusb_release_interface( l_sync.handle, l_sync.interface );
+  libusb_close( l_sync.handle );
+  libusb_exit( NULL );
+  return l_result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* End of file usbfs/host/sync_tool.c */
@@ -0,0 +1,176 @@
+/*
+ * usbfs/stats.c - part of the PicoW C/C++ Boilerplate Project
+ *
+ * Keeps count of what the storage layers ask of the flash; the number of
+ * erases of each sector, how much data has been programmed and read, and how
+ * long each erase or program kept interrupts disabled (as a histogram, with
+ * power-of-two sized buckets, in microseconds).
+ *
+ * The flash backend (flashio.c) reports each operation here; the figures are
+ * available through usbfs_get_stats() and friends in usbfs.c. Sectors are
+ * numbered from the start of the usbfs region of flash, and are physical
+ * sectors - including those used by wear levelling.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+/* System headers. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hardware/flash.h"
+
+
+/* Local headers. */
+
+#include "usbfs.h"
+
+
+/* Module variables. */
+
+static usbfs_stats_t  m_stats;
+static uint32_t      *m_sector_erases;
+static uint32_t       m_sector_count;
+
+
+/* Functions.*/
+
+/*
+ * record_irq_off - adds an interrupt-disabled period to the histogram.
+ */
+
+static void stats_record_irq_off( uint32_t p_duration_us )
+{
+  uint_fast8_t l_bucket = 0;
+
+  /* Find the right bucket; each one is double the size of the last. */
+  while( ( l_bucket < USBFS_STATS_BUCKETS - 1 ) && ( p_duration_us >> ( l_bucket + 1 ) ) )
+  {
+    l_bucket++;
+  }
+  m_stats.irq_off_histogram[l_bucket]++;
+
+  /* And keep track of the worst case. */
+  if ( p_duration_us > m_stats.irq_off_max_us )
+  {
+    m_stats.irq_off_max_us = p_duration_us;
+  }
+  return;
+}
+
+
+/*
+ * init - sets up the per-sector counters, for a region of the given size.
+ */
+
+void stats_init( uint32_t p_sectors )
+{
+  /* Throw away any previous counters. */
+  free( m_sector_erases );
+  m_sector_count = 0;
+
+  /* And allocate some new ones; if we can't, we just do without. */
+  m_sector_erases = (uint32_t *)calloc( p_sectors, sizeof( uint32_t ) );
+  if ( m_sector_erases != NULL )
+  {
+    m_sector_count = p_sectors;
+  }
+
+  /* All done. */
+  return;
+}
+
+
+/*
+ * erase - records the erase of a sector, or of a whole block of sectors; the
+ *         erase count is always in sectors.
+ */
+
+void stats_erase( uint32_t p_address, uint32_t p_size_bytes, uint32_t p_duration_us )
+{
+  uint32_t l_sector;
+
+  for ( l_sector = p_address / FLASH_SECTOR_SIZE; 
+        l_sector < ( p_address + p_size_bytes ) / FLASH_SECTOR_SIZE; l_sector++ )
+  {
+    m_stats.erases++;
+    if ( l_sector < m_sector_count )
+    {
+      m_sector_erases[l_sector]++;
+    }
+  }
+  stats_record_irq_off( p_duration_us );
+  return;
+}
+
+
+/*
+ * program - records a program of one or more pages.
+ */
+
+void stats_program( uint32_t p_size_bytes, uint32_t p_duration_us )
+{
+  m_stats.programs++;
+  m_stats.programmed_bytes += p_size_bytes;
+  stats_record_irq_off( p_duration_us );
+  return;
+}
+
+
+/*
+ * read - records a read from flash.
+ */
+
+void stats_read( uint32_t p_size_bytes )
+{
+  m_stats.reads++;
+  m_stats.read_bytes += p_size_bytes;
+  return;
+}
+
+
+/*
+ * get - fills in a copy of the current statistics.
+ */
+
+void stats_get( usbfs_stats_t *p_stats )
+{
+  memcpy( p_stats, &m_stats, sizeof( usbfs_stats_t ) );
+  p_stats->sectors = m_sector_count;
+  return;
+}
+
+
+/*
+ * get_erases - returns the number of times a sector has been erased.
+ */
+
+uint32_t stats_get_erases( uint32_t p_sector )
+{
+  if ( p_sector >= m_sector_count )
+  {
+    return 0;
+  }
+  return m_sector_erases[p_sector];
+}
+
+
+/*
+ * reset - zeroes all the statistics.
+ */
+
+void stats_reset( void )
+{
+  memset( &m_stats, 0, sizeof( usbfs_stats_t ) );
+  if ( m_sector_erases != NULL )
+  {
+    memset( m_sector_erases, 0, m_sector_count * sizeof( uint32_t ) );
+  }
+  return;
+}
+
+
+/* End of file usbfs/stats.c */
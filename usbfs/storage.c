@@ -2,11 +2,53 @@
  * usbfs/storage.cpp - part of the PicoW C/C++ Boilerplate Project
  *
  * These functions provide a common storage backend, to be used both by TinyUSB
- * and FatFS. The storage is simply a small section of flash at the end of memory.
+ * and FatFS. The storage is simply a section of flash, by default at the end of
+ * memory.
  * 
- * We allocated 128 sectors (~512kb) of storage, which the minimum that FatFS
- * will allow us to use. This takes quite a chunk out of the Pico flash, but it
- * is what it is.
+ * By default we allocate 128 sectors (~512kb) of storage, which the minimum
+ * that FatFS will allow us to use. This takes quite a chunk out of the Pico
+ * flash, but it is what it is. The size and placement can be changed at build
+ * time (see CMakeLists.txt), and an optional second 'scratch' partition can be
+ * added; each partition is presented as a separate LUN and FatFS volume.
+ *
+ * Both the host and FatFS address a partition in logical blocks of
+ * USBFS_BLOCK_SIZE (a whole 4kb flash sector, by default). Smaller blocks share
+ * a sector; writing one is a read-modify-write of its sector in the cache
+ * below, so the host never needs to know about the larger erase size.
+ *
+ * Writes are not sent straight to flash; instead, they are gathered in a small
+ * RAM cache of whole sectors, so that repeated writes to the same sector (FAT
+ * and directory updates, mostly) only cost a single erase. Dirty sectors are
+ * committed when FatFS asks for a sync, when they are evicted to make room for
+ * another sector, or when the cache has been idle for USBFS_CACHE_IDLE_MS.
+ *
+ * When a sector is committed, it is first compared to what's already in flash;
+ * unchanged pages are skipped entirely, and if the change only clears bits, the
+ * sector is programmed without being erased.
+ *
+ * If USBFS_WEAR_LEVEL is enabled, a sector which does need erasing is instead
+ * written to a fresh spare sector by the wear levelling layer (wearlevel.c).
+ *
+ * Commits are carried out a step at a time from storage_update(), each step
+ * being a single sector erase or page program; this keeps each period with
+ * interrupts disabled as short as the flash allows, and lets TinyUSB run in
+ * between. While a commit is in progress, writes that would disturb it are
+ * refused (by returning zero), which TinyUSB treats as "busy, try again". As
+ * TinyUSB asks again straight away, without returning to the main loop, each
+ * refusal also takes the commit a step further itself.
+ *
+ * Large writes from FatFS which cover whole, aligned 64kb blocks of flash are
+ * written directly by storage_write_bulk(), using a single block erase in place
+ * of sixteen sector erases (unless wear levelling is enabled).
+ *
+ * Reads from flash are streamed by DMA (see flashio.c); storage_read_async()
+ * lets TinyUSB start such a read and come back for the data later. TinyUSB
+ * comes straight back, though, so that is no less busy than waiting for it;
+ * the gain is in the read-ahead below, which does overlap the host. The first USBFS_HOT_SECTORS sectors of each partition (where
+ * FatFS keeps the boot sector, FAT and root directory) can instead be read via
+ * the XIP cache, as they are read far more often than anything else. When the
+ * host reads sequentially, the next sector is fetched into a read-ahead buffer
+ * in the background, ready for its next request.
  *
  * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
  * This file is released under the BSD 3-Clause License; see LICENSE for details.
@@ -18,8 +60,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "pico/stdlib.h"
 #include "hardware/flash.h"
-#include "hardware/sync.h"
 
 
 /* Local headers. */
@@ -27,23 +69,613 @@
 #include "usbfs.h"
 
 
+/* Constants. */
+
+#define STORAGE_BLOCKS      ( FLASH_SECTOR_SIZE / USBFS_BLOCK_SIZE )
+#define STORAGE_CHUNKS      ( FLASH_SECTOR_SIZE / USBFS_CACHE_CHUNK )
+#define STORAGE_ALL_CHUNKS  ( (uint32_t)( ( 1ull << STORAGE_CHUNKS ) - 1 ) )
+#define STORAGE_TRIES       100     /* Failed flash steps in a row before giving up */
+
+static_assert( STORAGE_CHUNKS <= 32, "USBFS_CACHE_CHUNK is too small" );
+static_assert( FLASH_SECTOR_SIZE % USBFS_CACHE_CHUNK == 0, "USBFS_CACHE_CHUNK must divide the sector size" );
+
+
+/* Structures. */
+
+typedef struct
+{
+  uint32_t  base;
+  uint32_t  sectors;
+} storage_partition_t;
+
+typedef struct
+{
+  uint8_t   part;
+  uint32_t  sector;
+  uint32_t  last_used;
+  uint32_t  filled;
+  uint8_t   data[FLASH_SECTOR_SIZE];
+  bool      valid;
+  bool      dirty;
+} storage_cache_t;
+
+typedef struct
+{
+  storage_cache_t  *entry;
+  uint32_t          address;
+  uint32_t          pages;
+  bool              erase;
+  bool              relocated;
+} storage_job_t;
+
+typedef struct
+{
+  uint8_t   part;
+  uint32_t  lba;
+  uint32_t  offset;
+  void     *buffer;
+  uint32_t  size;
+  bool      active;
+} storage_pending_read_t;
+
+typedef struct
+{
+  uint32_t  sector;
+  uint32_t  next_address;
+  uint8_t   data[FLASH_SECTOR_SIZE];
+  uint8_t   part;
+  uint8_t   next_part;
+  bool      valid;
+  bool      loading;
+} storage_readahead_t;
+
+
 /* Module variables. */
 
-static const uint32_t m_storage_size = FLASH_SECTOR_SIZE * 128;
-static const uint32_t m_storage_offset = PICO_FLASH_SIZE_BYTES - m_storage_size;
+static storage_partition_t  m_partitions[USBFS_PARTITIONS];
+static storage_cache_t      m_cache[USBFS_CACHE_SECTORS];
+static uint32_t             m_cache_clock;
+static bool                 m_cache_dirty;
+static absolute_time_t      m_cache_flush_time;
+static storage_job_t        m_job;
+static storage_pending_read_t m_read;
+static bool                 m_maintain_pending = true;
+static uint32_t             m_failures;
+#if USBFS_READAHEAD
+static storage_readahead_t  m_readahead;
+#endif
 
 
 /* Functions.*/
 
 /*
- * get_size - provides size information about storage. 
+ * address - returns the address in flash (relative to the start of our region)
+ *           where the logical sector of a partition currently lives.
+ */
+
+static uint32_t storage_address( uint8_t p_part, uint32_t p_sector )
+{
+#if USBFS_WEAR_LEVEL
+  return wl_address( p_part, p_sector );
+#else
+  return m_partitions[p_part].base + p_sector * FLASH_SECTOR_SIZE;
+#endif
+}
+
+
+/*
+ * partition_size - returns the number of sectors of flash a partition needs,
+ *                  to hold the requested number of logical sectors.
+ */
+
+static uint32_t storage_partition_size( uint32_t p_sectors )
+{
+#if USBFS_WEAR_LEVEL
+  return p_sectors + wl_get_overhead( p_sectors );
+#else
+  return p_sectors;
+#endif
+}
+
+
+/*
+ * cache_find - looks for the requested sector in the cache, returning NULL
+ *              if we don't currently hold it.
+ */
+
+static storage_cache_t *storage_cache_find( uint8_t p_part, uint32_t p_sector )
+{
+  uint_fast8_t  l_index;
+
+  /* Just a simple scan; the cache is only ever a handful of entries. */
+  for ( l_index = 0; l_index < USBFS_CACHE_SECTORS; l_index++ )
+  {
+    if ( m_cache[l_index].valid && 
+         ( m_cache[l_index].part == p_part ) && ( m_cache[l_index].sector == p_sector ) )
+    {
+      return &m_cache[l_index];
+    }
+  }
+
+  /* Not found then. */
+  return NULL;
+}
+
+
+/*
+ * chunks - returns a bitmap of the cache chunks touched by a range of bytes
+ *          within a sector.
+ */
+
+static uint32_t storage_chunks( uint32_t p_offset, uint32_t p_size_bytes )
+{
+  uint32_t l_first, l_last;
+
+  if ( p_size_bytes == 0 )
+  {
+    return 0;
+  }
+  l_first = p_offset / USBFS_CACHE_CHUNK;
+  l_last = ( p_offset + p_size_bytes - 1 ) / USBFS_CACHE_CHUNK;
+  return ( STORAGE_ALL_CHUNKS >> ( STORAGE_CHUNKS - 1 - l_last ) ) & ~( ( 1u << l_first ) - 1 );
+}
+
+
+/*
+ * cache_fill - makes sure the requested chunks of a cache entry hold data; any
+ *              that haven't been written yet are loaded from flash. Entries are
+ *              filled in lazily like this, so that a sector which is written
+ *              in its entirety (as the host does, in endpoint sized chunks)
+ *              never needs to be read from flash at all.
+ */
+
+static void storage_cache_fill( storage_cache_t *p_entry, uint32_t p_chunks )
+{
+  uint32_t      l_address;
+  uint_fast8_t  l_chunk, l_count;
+
+  /* Only worry about the chunks that are missing. */
+  p_chunks &= ~p_entry->filled;
+  if ( p_chunks == 0 )
+  {
+    return;
+  }
+
+  /* Load each run of missing chunks with a single read. */
+  l_address = storage_address( p_entry->part, p_entry->sector );
+  for ( l_chunk = 0; l_chunk < STORAGE_CHUNKS; l_chunk += l_count )
+  {
+    for ( l_count = 0; ( l_chunk + l_count < STORAGE_CHUNKS ) && 
+                       ( p_chunks & ( 1u << ( l_chunk + l_count ) ) ); l_count++ );
+    if ( l_count == 0 )
+    {
+      l_count = 1;
+      continue;
+    }
+    flashio_read( l_address + l_chunk * USBFS_CACHE_CHUNK, 
+                  p_entry->data + l_chunk * USBFS_CACHE_CHUNK, l_count * USBFS_CACHE_CHUNK );
+  }
+
+  /* And those chunks are now good. */
+  p_entry->filled |= p_chunks;
+  return;
+}
+
+
+#if USBFS_FLASH_COMPARE
+
+/*
+ * compare - compares a sector's worth of data with the current flash contents;
+ *           a bitmap of the pages which differ is filled in, and true is
+ *           returned if the sector needs to be erased. If the new data only
+ *           clears bits, we can program it in place instead.
+ */
+
+static bool storage_compare( const uint8_t *p_data, uint32_t p_address, uint32_t *p_changed )
+{
+  uint32_t        l_flash[FLASH_PAGE_SIZE / sizeof( uint32_t )];
+  const uint32_t *l_data;
+  uint32_t        l_page;
+  uint_fast16_t   l_index;
+  bool            l_erase = false;
+
+  /* Work through a page at a time, straight out of flash. */
+  *p_changed = 0;
+  for ( l_page = 0; l_page < FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE; l_page++ )
+  {
+    flashio_read( p_address + l_page * FLASH_PAGE_SIZE, l_flash, FLASH_PAGE_SIZE );
+    l_data = (const uint32_t *)( p_data + l_page * FLASH_PAGE_SIZE );
+    for ( l_index = 0; l_index < FLASH_PAGE_SIZE / sizeof( uint32_t ); l_index++ )
+    {
+      if ( l_flash[l_index] != l_data[l_index] )
+      {
+        *p_changed |= 1u << l_page;
+      }
+
+      /* Programming can only ever turn a 1 into a 0. */
+      if ( ( l_flash[l_index] & l_data[l_index] ) != l_data[l_index] )
+      {
+        l_erase = true;
+      }
+    }
+  }
+
+  /* Let the caller know if an erase is needed. */
+  return l_erase;
+}
+
+#endif /* USBFS_FLASH_COMPARE */
+
+
+/*
+ * page_erased - checks to see if a page of data is all ones, which is what
+ *               an erased sector already holds.
+ */
+
+static bool storage_page_erased( const uint8_t *p_data )
+{
+  const uint32_t *l_data = (const uint32_t *)p_data;
+  uint_fast16_t   l_index;
+
+  for ( l_index = 0; l_index < FLASH_PAGE_SIZE / sizeof( uint32_t ); l_index++ )
+  {
+    if ( l_data[l_index] != 0xFFFFFFFF )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+/*
+ * retry - called when a step can't be written to flash right now; returns true
+ *         if it's worth trying again, or false once steps have failed
+ *         STORAGE_TRIES times in a row, when the caller should give up with an
+ *         error. That holds until a step succeeds again.
+ */
+
+static bool storage_retry( void )
+{
+  if ( m_failures < STORAGE_TRIES )
+  {
+    m_failures++;
+  }
+  return m_failures < STORAGE_TRIES;
+}
+
+
+/*
+ * commit_start - begins committing a dirty cache entry to flash. Clean entries
+ *                are left alone. Unless USBFS_FLASH_COMPARE is turned off, only
+ *                pages that differ from flash will be programmed, and the
+ *                sector is only erased (or relocated) if we need to set any bits.
+ *                The work itself is done by storage_commit_step().
+ */
+
+static void storage_commit_start( storage_cache_t *p_entry )
+{
+  uint32_t  l_page, l_changed = ~0u;
+  bool      l_erase = true;
+
+  /* Nothing to do if the entry doesn't hold any unsaved data. */
+  if ( !p_entry->valid || !p_entry->dirty )
+  {
+    return;
+  }
+
+  /* Any part of the sector which hasn't been written has to be kept. */
+  storage_cache_fill( p_entry, STORAGE_ALL_CHUNKS );
+
+  /* Work out what the current flash contents need. */
+  m_job.entry = p_entry;
+  m_job.address = storage_address( p_entry->part, p_entry->sector );
+  m_job.relocated = false;
+#if USBFS_FLASH_COMPARE
+  l_erase = storage_compare( p_entry->data, m_job.address, &l_changed );
+#endif
+
+  /* Only erase the sector (or move to a fresh one) if we really have to. */
+  m_job.erase = l_erase;
+#if USBFS_WEAR_LEVEL
+  if ( l_erase )
+  {
+    m_job.address = wl_relocate( p_entry->part, &m_job.erase );
+    m_job.relocated = true;
+  }
+#endif
+
+  /* And then program each page which doesn't already hold the right data. */
+  m_job.pages = 0;
+  for ( l_page = 0; l_page < FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE; l_page++ )
+  {
+    if ( l_erase ? !storage_page_erased( p_entry->data + l_page * FLASH_PAGE_SIZE )
+                 : ( ( l_changed & ( 1u << l_page ) ) != 0 ) )
+    {
+      m_job.pages |= 1u << l_page;
+    }
+  }
+
+  /* All done. */
+  return;
+}
+
+
+/*
+ * commit_step - performs the next step of the current commit; either a single
+ *               sector erase, or a single page program (or, with wear
+ *               levelling, a step in recording where the sector went). Once
+ *               there is nothing left to do, the entry is marked as clean. If
+ *               a step can't be performed (because the other core couldn't be
+ *               parked in time), it will simply be tried again on the next
+ *               call; but if that keeps happening, false is returned to report
+ *               the failure. The commit itself stays in place, to be retried.
+ */
+
+static bool storage_commit_step( void )
+{
+  uint32_t  l_page, l_count;
+#if USBFS_WEAR_LEVEL
+  bool      l_done;
+#endif
+
+  /* Make sure there is a commit in progress. */
+  if ( m_job.entry == NULL )
+  {
+    return true;
+  }
+
+  /* The erase (if we need one) comes first. */
+  if ( m_job.erase )
+  {
+    if ( !flashio_erase( m_job.address ) )
+    {
+      return storage_retry();
+    }
+    m_job.erase = false;
+    m_failures = 0;
+    return true;
+  }
+
+  /* Then we program each run of changed pages, up to USBFS_PROGRAM_PAGES. */
+  if ( m_job.pages != 0 )
+  {
+    for ( l_page = 0; ( m_job.pages & ( 1u << l_page ) ) == 0; l_page++ );
+    for ( l_count = 1; ( l_count < USBFS_PROGRAM_PAGES ) && 
+                       ( m_job.pages & ( 1u << ( l_page + l_count ) ) ); l_count++ );
+    if ( !flashio_program( 
+           m_job.address + l_page * FLASH_PAGE_SIZE, 
+           m_job.entry->data + l_page * FLASH_PAGE_SIZE, l_count * FLASH_PAGE_SIZE 
+         ) )
+    {
+      return storage_retry();
+    }
+    m_job.pages &= ~( ( ( 1u << l_count ) - 1 ) << l_page );
+    m_failures = 0;
+    return true;
+  }
+
+#if USBFS_WEAR_LEVEL
+  /* If the sector moved, make that permanent; that may take a few steps. */
+  if ( m_job.relocated )
+  {
+    if ( !wl_commit( m_job.entry->part, m_job.entry->sector, m_job.address, &l_done ) )
+    {
+      return storage_retry();
+    }
+    m_failures = 0;
+    if ( !l_done )
+    {
+      return true;
+    }
+  }
+#endif
+
+  /* Anything it replaced will want erasing, in the background. */
+  if ( m_job.relocated )
+  {
+    m_maintain_pending = true;
+  }
+
+  /* The entry now matches flash, and we're free for the next commit. */
+  m_job.entry->dirty = false;
+  m_job.entry = NULL;
+  m_failures = 0;
+  return true;
+}
+
+
+/*
+ * cache_commit - commits a cache entry to flash, waiting until it's done.
+ *                Returns false if the flash couldn't be written.
+ */
+
+static bool storage_cache_commit( storage_cache_t *p_entry )
+{
+  /* If something else is in progress, that needs to finish first. */
+  while( m_job.entry != NULL )
+  {
+    if ( !storage_commit_step() )
+    {
+      return false;
+    }
+  }
+
+  /* And then run our own commit through to the end. */
+  storage_commit_start( p_entry );
+  while( m_job.entry != NULL )
+  {
+    if ( !storage_commit_step() )
+    {
+      return false;
+    }
+  }
+
+  /* All done. */
+  return true;
+}
+
+
+/*
+ * cache_claim - fetches a cache entry for the requested sector, evicting the
+ *               least recently used entry if we don't already hold it. A new
+ *               entry starts off empty; see storage_cache_fill(). If the entry
+ *               can't be used yet because it's being committed, or because
+ *               the victim must be committed first, NULL is returned.
+ */
+
+static storage_cache_t *storage_cache_claim( uint8_t p_part, uint32_t p_sector )
+{
+  uint_fast8_t     l_index;
+  storage_cache_t *l_entry;
+
+#if USBFS_READAHEAD
+  /* Once the sector is being written, any read-ahead copy will be stale. */
+  if ( m_readahead.valid && ( m_readahead.part == p_part ) && ( m_readahead.sector == p_sector ) )
+  {
+    m_readahead.valid = false;
+  }
+#endif
+
+  /* If we already have it, there's not much to do. */
+  l_entry = storage_cache_find( p_part, p_sector );
+  if ( l_entry != NULL )
+  {
+    /* Unless it's being written to flash right now, of course. */
+    if ( l_entry == m_job.entry )
+    {
+      return NULL;
+    }
+    l_entry->last_used = ++m_cache_clock;
+    return l_entry;
+  }
+
+  /* Pick a victim; any unused entry, or else the least recently used one. */
+  l_entry = &m_cache[0];
+  for ( l_index = 0; l_index < USBFS_CACHE_SECTORS; l_index++ )
+  {
+    if ( !m_cache[l_index].valid )
+    {
+      l_entry = &m_cache[l_index];
+      break;
+    }
+    if ( m_cache[l_index].last_used < l_entry->last_used )
+    {
+      l_entry = &m_cache[l_index];
+    }
+  }
+
+  /* If the victim holds unsaved data, it has to make it to flash first. */
+  if ( l_entry->valid && l_entry->dirty )
+  {
+    if ( m_job.entry == NULL )
+    {
+      storage_commit_start( l_entry );
+    }
+    return NULL;
+  }
+
+  /* And take it over for the new sector. */
+  l_entry->part = p_part;
+  l_entry->sector = p_sector;
+  l_entry->valid = true;
+  l_entry->dirty = false;
+  l_entry->filled = 0;
+  l_entry->last_used = ++m_cache_clock;
+
+  /* All done. */
+  return l_entry;
+}
+
+
+/*
+ * init - works out the layout of our partitions, and sets up the flash region
+ *        and any wear levelling within it. Returns false if the storage could
+ *        not be made ready (most likely, because it would overlap the program).
  */
 
-void storage_get_size( uint16_t *p_block_size, uint32_t *p_num_blocks )
+bool storage_init( void )
+{
+  uint32_t      l_start, l_end, l_free, l_scratch;
+#if USBFS_WEAR_LEVEL
+  uint_fast8_t  l_part;
+#endif
+
+  /* Work out where the free flash is; never before the end of our program. */
+  l_free = flashio_get_free();
+  l_start = USBFS_STORAGE_OFFSET > 0 ? USBFS_STORAGE_OFFSET : l_free;
+  l_end = PICO_FLASH_SIZE_BYTES;
+  if ( ( l_start < l_free ) || ( l_start >= l_end ) || ( l_start % FLASH_SECTOR_SIZE != 0 ) )
+  {
+    return false;
+  }
+
+  /* The scratch partition (if any) sits before the main one. */
+#if USBFS_PARTITIONS > 1
+  m_partitions[1].sectors = USBFS_SCRATCH_SECTORS;
+  l_scratch = storage_partition_size( USBFS_SCRATCH_SECTORS );
+#else
+  l_scratch = 0;
+#endif
+
+  /* The main partition is either a fixed size, or takes whatever is left. */
+  m_partitions[0].sectors = USBFS_STORAGE_SECTORS;
+  if ( m_partitions[0].sectors == 0 )
+  {
+    m_partitions[0].sectors = ( l_end - l_start ) / FLASH_SECTOR_SIZE - l_scratch;
+    while( ( m_partitions[0].sectors > 0 ) &&
+           ( storage_partition_size( m_partitions[0].sectors ) + l_scratch > ( l_end - l_start ) / FLASH_SECTOR_SIZE ) )
+    {
+      m_partitions[0].sectors--;
+    }
+  }
+
+  /* Now we can place everything; with a fixed size, it goes at the very end. */
+  if ( USBFS_STORAGE_OFFSET == 0 )
+  {
+    l_start = l_end - ( storage_partition_size( m_partitions[0].sectors ) + l_scratch ) * FLASH_SECTOR_SIZE;
+  }
+  l_end = l_start + ( storage_partition_size( m_partitions[0].sectors ) + l_scratch ) * FLASH_SECTOR_SIZE;
+  if ( ( m_partitions[0].sectors == 0 ) || ( l_start < l_free ) || ( l_end > PICO_FLASH_SIZE_BYTES ) )
+  {
+    return false;
+  }
+  flashio_init( l_start, l_end - l_start );
+  stats_init( ( l_end - l_start ) / FLASH_SECTOR_SIZE );
+
+  /* Partitions are addressed relative to the start of the region. */
+  m_partitions[0].base = l_scratch * FLASH_SECTOR_SIZE;
+#if USBFS_PARTITIONS > 1
+  m_partitions[1].base = 0;
+#endif
+
+#if USBFS_WEAR_LEVEL
+  /* Wear levelling has to be set up for each partition separately. */
+  for ( l_part = 0; l_part < USBFS_PARTITIONS; l_part++ )
+  {
+    if ( !wl_init( l_part, m_partitions[l_part].base, m_partitions[l_part].sectors ) )
+    {
+      return false;
+    }
+  }
+#endif
+
+  /* All done. */
+  return true;
+}
+
+
+/*
+ * get_size - provides size information about a partition, in the logical
+ *            blocks it is addressed in; each flash sector holds several of
+ *            these, unless USBFS_BLOCK_SIZE is the full sector size.
+ */
+
+void storage_get_size( uint8_t p_part, uint16_t *p_block_size, uint32_t *p_num_blocks )
 {
   /* Very simple look up. */
-  *p_block_size = FLASH_SECTOR_SIZE;
-  *p_num_blocks = m_storage_size / FLASH_SECTOR_SIZE;
+  *p_block_size = USBFS_BLOCK_SIZE;
+  *p_num_blocks = m_partitions[p_part].sectors * STORAGE_BLOCKS;
 
   /* All done. */
   return;
@@ -51,18 +683,54 @@ void storage_get_size( uint16_t *p_block_size, uint32_t *p_num_blocks )
 
 
 /*
- * read - fetches data from flash.
+ * read - fetches data from flash, or from the cache if we hold unsaved data
+ *        for the sector in question.
  */
 
-int32_t storage_read( uint32_t p_sector, uint32_t p_offset, 
+int32_t storage_read( uint8_t p_part, uint32_t p_lba, uint32_t p_offset, 
                       void *p_buffer, uint32_t p_size_bytes )
 {
-  /* Very simple copy out of flash then! */
-  memcpy( 
-    p_buffer, 
-    (uint8_t *)XIP_NOCACHE_NOALLOC_BASE + m_storage_offset + p_sector * FLASH_SECTOR_SIZE + p_offset, 
-    p_size_bytes
-  );
+  uint32_t         l_address, l_sector, l_offset, l_chunk, l_done;
+  storage_cache_t *l_entry;
+
+  /* Make sure the request lies within the partition. */
+  l_address = p_lba * USBFS_BLOCK_SIZE + p_offset;
+  if ( ( p_part >= USBFS_PARTITIONS ) ||
+       ( l_address + p_size_bytes > m_partitions[p_part].sectors * FLASH_SECTOR_SIZE ) )
+  {
+    return -1;
+  }
+
+  /* Work through the request a sector at a time. */
+  for ( l_done = 0; l_done < p_size_bytes; l_done += l_chunk )
+  {
+    l_sector = ( l_address + l_done ) / FLASH_SECTOR_SIZE;
+    l_offset = ( l_address + l_done ) % FLASH_SECTOR_SIZE;
+    l_chunk = FLASH_SECTOR_SIZE - l_offset;
+    if ( l_chunk > p_size_bytes - l_done )
+    {
+      l_chunk = p_size_bytes - l_done;
+    }
+
+    /* If the cache holds this sector, it's the most up to date copy. */
+    l_entry = storage_cache_find( p_part, l_sector );
+    if ( l_entry != NULL )
+    {
+      storage_cache_fill( l_entry, storage_chunks( l_offset, l_chunk ) );
+      memcpy( (uint8_t *)p_buffer + l_done, l_entry->data + l_offset, l_chunk );
+      continue;
+    }
+
+    /* Otherwise, it comes from flash; hot sectors are read via the cache. */
+    if ( l_sector < USBFS_HOT_SECTORS )
+    {
+      flashio_read_cached( storage_address( p_part, l_sector ) + l_offset, (uint8_t *)p_buffer + l_done, l_chunk );
+    }
+    else
+    {
+      flashio_read( storage_address( p_part, l_sector ) + l_offset, (uint8_t *)p_buffer + l_done, l_chunk );
+    }
+  }
 
   /* And return how much we read. */
   return p_size_bytes;
@@ -70,34 +738,450 @@ int32_t storage_read( uint32_t p_sector, uint32_t p_offset,
 
 
 /*
- * write - stores data into flash, with appropriate guards. 
+ * readahead_start - starts loading a sector into the read-ahead buffer, in the
+ *                   background. Returns false if it can't be done that way.
  */
 
-int32_t storage_write( uint32_t p_sector, uint32_t p_offset,
-                       const uint8_t *p_buffer, uint32_t p_size_bytes )
+#if USBFS_READAHEAD
+
+static bool storage_readahead_start( uint8_t p_part, uint32_t p_sector )
+{
+  /* Only sectors that exist, and that we'd otherwise read from flash. */
+  m_readahead.valid = false;
+  if ( ( p_sector >= m_partitions[p_part].sectors ) || ( p_sector < USBFS_HOT_SECTORS ) ||
+       ( storage_cache_find( p_part, p_sector ) != NULL ) )
+  {
+    return false;
+  }
+
+  /* Start the read, and remember what's on its way. */
+  if ( !flashio_read_start( storage_address( p_part, p_sector ), m_readahead.data, FLASH_SECTOR_SIZE ) )
+  {
+    return false;
+  }
+  m_readahead.part = p_part;
+  m_readahead.sector = p_sector;
+  m_readahead.valid = true;
+  m_readahead.loading = true;
+  return true;
+}
+
+#endif /* USBFS_READAHEAD */
+
+
+/*
+ * read_async - works like storage_read(), but where the data has to come from
+ *              flash, the read is started and zero is returned; calling again
+ *              with the same parameters will return zero until the data has
+ *              arrived. This suits the TinyUSB read callback, which handles a
+ *              zero return by trying again (immediately, so the CPU is no
+ *              freer than if it had waited for the read).
+ *
+ *              When the host reads sequentially, whole sectors are loaded into
+ *              the read-ahead buffer instead, and as soon as the host reaches
+ *              the end of one sector, the next is loaded in the background
+ *              while the host handles this one; the following reads can then
+ *              usually be served straight from RAM.
+ */
+
+int32_t storage_read_async( uint8_t p_part, uint32_t p_lba, uint32_t p_offset, 
+                            void *p_buffer, uint32_t p_size_bytes )
 {
-  uint32_t l_status;
+  uint32_t         l_address, l_sector, l_offset;
+  storage_cache_t *l_entry;
+#if USBFS_READAHEAD
+  bool             l_sequential;
+#endif
 
-  /* Don't want to be interrupted. */
-  l_status = save_and_disable_interrupts();
+  /* Make sure the request lies within the partition. */
+  l_address = p_lba * USBFS_BLOCK_SIZE + p_offset;
+  if ( ( p_part >= USBFS_PARTITIONS ) ||
+       ( l_address + p_size_bytes > m_partitions[p_part].sectors * FLASH_SECTOR_SIZE ) )
+  {
+    return -1;
+  }
+  l_sector = l_address / FLASH_SECTOR_SIZE;
+  l_offset = l_address % FLASH_SECTOR_SIZE;
 
-  /* Erasing with an offset of 0? Seems odd, but... */
-  if ( p_offset == 0 )
+  /* Is this the read we already have underway? */
+  if ( m_read.active && ( m_read.part == p_part ) && ( m_read.lba == p_lba ) &&
+       ( m_read.offset == p_offset ) && ( m_read.buffer == p_buffer ) &&
+       ( m_read.size == p_size_bytes ) )
   {
-    flash_range_erase( m_storage_offset + p_sector * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE );
+    /* If it's still going, come back later. */
+    if ( flashio_read_busy() )
+    {
+      return 0;
+    }
+    m_read.active = false;
+
+    /* If the sector was written meanwhile, the cache has the newer copy. */
+    l_entry = storage_cache_find( p_part, l_sector );
+    if ( l_entry != NULL )
+    {
+      storage_cache_fill( l_entry, storage_chunks( l_offset, p_size_bytes ) );
+      memcpy( p_buffer, l_entry->data + l_offset, p_size_bytes );
+    }
+    return p_size_bytes;
+  }
+  m_read.active = false;
+
+  /* Reads that span sectors, or come from the cache, are done straight away. */
+  if ( ( l_offset + p_size_bytes > FLASH_SECTOR_SIZE ) || ( l_sector < USBFS_HOT_SECTORS ) ||
+       ( storage_cache_find( p_part, l_sector ) != NULL ) )
+  {
+    return storage_read( p_part, p_lba, p_offset, p_buffer, p_size_bytes );
   }
 
-  /* And just write the data now. */
-  flash_range_program( 
-    m_storage_offset + p_sector * FLASH_SECTOR_SIZE + p_offset, 
-    p_buffer, p_size_bytes
-  );
+#if USBFS_READAHEAD
+  /* Does this follow on from the last read? */
+  l_sequential = ( p_part == m_readahead.next_part ) && ( l_address == m_readahead.next_address );
+
+  /* If the host is reading sequentially, load the whole sector ahead of it. */
+  if ( l_sequential && !( m_readahead.valid && ( m_readahead.part == p_part ) && 
+                          ( m_readahead.sector == l_sector ) ) )
+  {
+    if ( storage_readahead_start( p_part, l_sector ) )
+    {
+      return 0;
+    }
+  }
+
+  /* If the read-ahead buffer has (or will have) this sector, use it. */
+  if ( m_readahead.valid && ( m_readahead.part == p_part ) && ( m_readahead.sector == l_sector ) )
+  {
+    if ( m_readahead.loading && flashio_read_busy() )
+    {
+      return 0;
+    }
+    m_readahead.loading = false;
+    memcpy( p_buffer, m_readahead.data + l_offset, p_size_bytes );
+
+    /* If that's the end of this sector, start fetching the next one. */
+    m_readahead.next_part = p_part;
+    m_readahead.next_address = l_address + p_size_bytes;
+    if ( l_offset + p_size_bytes == FLASH_SECTOR_SIZE )
+    {
+      storage_readahead_start( p_part, l_sector + 1 );
+    }
+    return p_size_bytes;
+  }
+
+  /* Otherwise, note where the next read would be if this one is sequential. */
+  m_readahead.next_part = p_part;
+  m_readahead.next_address = l_address + p_size_bytes;
+#endif
+
+  /* Start a read of just what was asked for. */
+  if ( !flashio_read_start( storage_address( p_part, l_sector ) + l_offset, p_buffer, p_size_bytes ) )
+  {
+    return storage_read( p_part, p_lba, p_offset, p_buffer, p_size_bytes );
+  }
+
+  /* The read is underway; remember it, for when we're called again. */
+  m_read.part = p_part;
+  m_read.lba = p_lba;
+  m_read.offset = p_offset;
+  m_read.buffer = p_buffer;
+  m_read.size = p_size_bytes;
+  m_read.active = true;
+  return 0;
+}
+
+
+/*
+ * write - stores data into the sector cache; it will be committed to flash
+ *         later, by storage_flush() or storage_update(). If the cache is busy,
+ *         less data than requested (possibly none) will be accepted, and the
+ *         caller should try again with the remainder; the commit in the way
+ *         is moved on by a step each time, so it's fine to do so immediately.
+ *         If that commit can't be written to flash at all, -1 is returned.
+ */
+
+int32_t storage_write( uint8_t p_part, uint32_t p_lba, uint32_t p_offset,
+                       const uint8_t *p_buffer, uint32_t p_size_bytes )
+{
+  uint32_t         l_address, l_sector, l_offset, l_chunk, l_done, l_first, l_last;
+  storage_cache_t *l_entry;
+
+  /* Make sure the request lies within the partition. */
+  l_address = p_lba * USBFS_BLOCK_SIZE + p_offset;
+  if ( ( p_part >= USBFS_PARTITIONS ) ||
+       ( l_address + p_size_bytes > m_partitions[p_part].sectors * FLASH_SECTOR_SIZE ) )
+  {
+    return -1;
+  }
+
+  /* Work through the request a sector at a time. */
+  for ( l_done = 0; l_done < p_size_bytes; l_done += l_chunk )
+  {
+    l_sector = ( l_address + l_done ) / FLASH_SECTOR_SIZE;
+    l_offset = ( l_address + l_done ) % FLASH_SECTOR_SIZE;
+    l_chunk = FLASH_SECTOR_SIZE - l_offset;
+    if ( l_chunk > p_size_bytes - l_done )
+    {
+      l_chunk = p_size_bytes - l_done;
+    }
+
+    /* Find a cache entry for the sector. */
+    l_entry = storage_cache_claim( p_part, l_sector );
+    if ( l_entry == NULL )
+    {
+      if ( !storage_commit_step() && ( l_done == 0 ) )
+      {
+        return -1;
+      }
+      break;
+    }
+
+    /* Chunks we only partly overwrite need their current contents first. */
+    l_first = l_offset / USBFS_CACHE_CHUNK;
+    l_last = ( l_offset + l_chunk - 1 ) / USBFS_CACHE_CHUNK;
+    if ( l_offset % USBFS_CACHE_CHUNK )
+    {
+      storage_cache_fill( l_entry, 1u << l_first );
+    }
+    if ( ( l_offset + l_chunk ) % USBFS_CACHE_CHUNK )
+    {
+      storage_cache_fill( l_entry, 1u << l_last );
+    }
+
+    /* And update it. */
+    memcpy( l_entry->data + l_offset, p_buffer + l_done, l_chunk );
+    l_entry->filled |= storage_chunks( l_offset, l_chunk );
+    l_entry->dirty = true;
+  }
 
-  /* Lastly, restore our interrupts. */
-  restore_interrupts( l_status );
+  /* Remember that we have work to do, and push back the idle timeout. */
+  if ( l_done > 0 )
+  {
+    m_cache_dirty = true;
+    m_cache_flush_time = make_timeout_time_ms( USBFS_CACHE_IDLE_MS );
+  }
 
   /* Before returning the amount of data written. */
-  return p_size_bytes;
+  return l_done;
+}
+
+
+/*
+ * write_bulk - writes a large run of data, as used by FatFS when writing big
+ *              files. Whole, aligned 64kb blocks are written straight to flash,
+ *              bypassing the cache, with a single block erase in place of
+ *              sixteen sector erases; anything else goes through the cache as
+ *              normal, via storage_write(). As with storage_write(), less data
+ *              than requested (possibly none) may be accepted.
+ *
+ *              Block erases work in place, so aren't used when wear levelling
+ *              is enabled, as they would undo its work.
+ *
+ *              If the flash can't be written right now, nothing is accepted
+ *              and the caller should try again, just as for the cache; if it
+ *              keeps failing, an error is returned.
+ */
+
+int32_t storage_write_bulk( uint8_t p_part, uint32_t p_lba, uint32_t p_offset,
+                            const uint8_t *p_buffer, uint32_t p_size_bytes )
+{
+#if USBFS_BLOCK_ERASE && !USBFS_WEAR_LEVEL
+  uint32_t         l_address, l_flash, l_done, l_page;
+  uint_fast8_t     l_index;
+#if USBFS_FLASH_COMPARE
+  uint32_t         l_changed;
+  bool             l_erase = false;
+#endif
+
+  /* Make sure the request lies within the partition. */
+  l_address = p_lba * USBFS_BLOCK_SIZE + p_offset;
+  if ( ( p_part >= USBFS_PARTITIONS ) ||
+       ( l_address + p_size_bytes > m_partitions[p_part].sectors * FLASH_SECTOR_SIZE ) )
+  {
+    return -1;
+  }
+
+  /* If we're not at the start of a whole block, use the cache up to the next. */
+  l_flash = storage_address( p_part, 0 ) + l_address;
+  if ( flashio_block_offset( l_flash ) != 0 )
+  {
+    l_done = FLASH_BLOCK_SIZE - flashio_block_offset( l_flash );
+    return storage_write( p_part, p_lba, p_offset, p_buffer, 
+                          p_size_bytes < l_done ? p_size_bytes : l_done );
+  }
+  if ( ( p_size_bytes < FLASH_BLOCK_SIZE ) || ( (uintptr_t)p_buffer & 3 ) )
+  {
+    return storage_write( p_part, p_lba, p_offset, p_buffer, p_size_bytes );
+  }
+
+  /* If nothing in the block needs erasing, the cache will do a better job. */
+#if USBFS_FLASH_COMPARE
+  for ( l_done = 0; !l_erase && ( l_done < FLASH_BLOCK_SIZE ); l_done += FLASH_SECTOR_SIZE )
+  {
+    l_erase = storage_compare( p_buffer + l_done, l_flash + l_done, &l_changed );
+  }
+  if ( !l_erase )
+  {
+    return storage_write( p_part, p_lba, p_offset, p_buffer, FLASH_BLOCK_SIZE );
+  }
+#endif
+
+  /* Any commit in progress has to finish first, in case it's for this block. */
+  if ( m_job.entry != NULL )
+  {
+    return storage_commit_step() ? 0 : -1;
+  }
+
+  /* Anything cached for this block is about to be overwritten, so drop it. */
+  for ( l_index = 0; l_index < USBFS_CACHE_SECTORS; l_index++ )
+  {
+    if ( m_cache[l_index].valid && ( m_cache[l_index].part == p_part ) &&
+         ( m_cache[l_index].sector >= l_address / FLASH_SECTOR_SIZE ) &&
+         ( m_cache[l_index].sector < ( l_address + FLASH_BLOCK_SIZE ) / FLASH_SECTOR_SIZE ) )
+    {
+      m_cache[l_index].valid = false;
+    }
+  }
+#if USBFS_READAHEAD
+  if ( m_readahead.valid && ( m_readahead.part == p_part ) &&
+       ( m_readahead.sector >= l_address / FLASH_SECTOR_SIZE ) &&
+       ( m_readahead.sector < ( l_address + FLASH_BLOCK_SIZE ) / FLASH_SECTOR_SIZE ) )
+  {
+    m_readahead.valid = false;
+  }
+#endif
+
+  /*
+   * Erase the whole block in one go, then program every page that needs it.
+   * If either fails, none of it is accepted, and it all starts again on the
+   * caller's next attempt.
+   */
+  if ( !flashio_erase_block( l_flash ) )
+  {
+    return storage_retry() ? 0 : -1;
+  }
+  for ( l_page = 0; l_page < FLASH_BLOCK_SIZE; l_page += FLASH_PAGE_SIZE )
+  {
+    if ( !storage_page_erased( p_buffer + l_page ) &&
+         !flashio_program( l_flash + l_page, p_buffer + l_page, FLASH_PAGE_SIZE ) )
+    {
+      return storage_retry() ? 0 : -1;
+    }
+  }
+
+  /* And that's the whole block written. */
+  m_failures = 0;
+  return FLASH_BLOCK_SIZE;
+#else
+  /* Without block erases, this is just a normal write. */
+  return storage_write( p_part, p_lba, p_offset, p_buffer, p_size_bytes );
+#endif
+}
+
+
+/*
+ * flush - commits any unsaved data in the cache to flash. Returns false if
+ *         some of it couldn't be written; it stays in the cache, and will be
+ *         tried again later.
+ */
+
+bool storage_flush( void )
+{
+  uint_fast8_t l_index;
+
+  /* Simply commit every entry; clean ones will be skipped. */
+  for ( l_index = 0; l_index < USBFS_CACHE_SECTORS; l_index++ )
+  {
+    if ( !storage_cache_commit( &m_cache[l_index] ) )
+    {
+      return false;
+    }
+  }
+
+  /* And the cache is now clean. */
+  m_cache_dirty = false;
+  return true;
+}
+
+
+/*
+ * update - called regularly to move any commit in progress along by a step,
+ *          and to start flushing the cache once it has been idle for a while,
+ *          so that unsaved data doesn't hang around indefinitely.
+ */
+
+void storage_update( void )
+{
+  uint_fast8_t l_index;
+
+  /* If a commit is in progress, just take the next step. */
+  if ( m_job.entry != NULL )
+  {
+    storage_commit_step();
+    return;
+  }
+
+  /* Only flush if there's unsaved data, and we've waited long enough. */
+  if ( m_cache_dirty && time_reached( m_cache_flush_time ) )
+  {
+    /* Start on the first dirty entry; the rest will follow on later calls. */
+    for ( l_index = 0; l_index < USBFS_CACHE_SECTORS; l_index++ )
+    {
+      if ( m_cache[l_index].valid && m_cache[l_index].dirty )
+      {
+        storage_commit_start( &m_cache[l_index] );
+        return;
+      }
+    }
+
+    /* Nothing dirty left, so the cache is clean. */
+    m_cache_dirty = false;
+    return;
+  }
+
+#if USBFS_WEAR_LEVEL
+  /* When we're otherwise idle, get a spare sector erased ahead of time. */
+  if ( !m_cache_dirty && m_maintain_pending )
+  {
+    m_maintain_pending = wl_maintain();
+  }
+#endif
+
+  /* All done. */
+  return;
+}
+
+
+/*
+ * next_update - returns the time by which storage_update() next needs to be
+ *               called; this lets the caller sleep until then, if nothing
+ *               else needs doing.
+ */
+
+absolute_time_t storage_next_update( void )
+{
+  /* A commit in progress, or background erases, want attention right away. */
+  if ( ( m_job.entry != NULL ) || ( USBFS_WEAR_LEVEL && !m_cache_dirty && m_maintain_pending ) )
+  {
+    return get_absolute_time();
+  }
+
+  /* Unsaved data will need flushing once the cache has been idle long enough. */
+  if ( m_cache_dirty )
+  {
+    return m_cache_flush_time;
+  }
+
+  /* Otherwise, there's nothing to do until something else happens. */
+  return at_the_end_of_time;
+}
+
+
+/*
+ * busy - returns true if the storage layer has a commit in progress.
+ */
+
+bool storage_busy( void )
+{
+  return m_job.entry != NULL;
 }
 
 
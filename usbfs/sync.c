@@ -0,0 +1,410 @@
+/*
+ * usbfs/sync.c - part of the PicoW C/C++ Boilerplate Project
+ *
+ * An optional vendor-class USB interface, alongside MSC, which lets a host
+ * list, read, write and delete files directly through the usbfs file API (see
+ * sync.h for the protocol). A file is pushed or pulled in a single streamed
+ * transfer, rather than as many SCSI commands plus FAT metadata traffic. Writes
+ * and deletes are still local changes, though, so a host with the drive mounted
+ * is told about them (and re-reads it) just as for any other.
+ *
+ * Everything is driven from sync_update(), which is called alongside tud_task()
+ * and never waits for the host; it does as much as the USB buffers allow, and
+ * picks up where it left off on the next call.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+/* System headers. */
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Local headers. */
+
+#include "tusb.h"
+#include "usbfs.h"
+#include "sync.h"
+
+
+#if USBFS_VENDOR
+
+/* Constants. */
+
+#define SYNC_CHUNK          512
+#define SYNC_TIMEOUT_MS     2000
+
+
+/* Structures. */
+
+typedef enum
+{
+  SYNC_IDLE,
+  SYNC_NAME,
+  SYNC_RECEIVE,
+  SYNC_SEND,
+  SYNC_LIST
+} sync_state_t;
+
+
+/* Module variables. */
+
+static sync_state_t     m_state;
+static sync_header_t    m_request;
+static uint32_t         m_received;
+static char             m_name[SYNC_MAX_NAME+1];
+static uint32_t         m_remaining;
+static uint8_t          m_status;
+static usbfs_file_t    *m_file;
+static DIR              m_dir;
+static absolute_time_t  m_timeout;
+
+static uint8_t          m_pending[SYNC_CHUNK];
+static uint32_t         m_pending_length;
+static uint32_t         m_pending_sent;
+
+
+/* Functions.*/
+
+/*
+ * send_pending - sends as much of the pending data to the host as it has room
+ *                for; returns true once all of it has gone.
+ */
+
+static bool sync_send_pending( void )
+{
+  uint32_t l_sent;
+
+  if ( m_pending_sent < m_pending_length )
+  {
+    /* As long as the host takes something, it's still there. */
+    l_sent = tud_vendor_write( m_pending + m_pending_sent, m_pending_length - m_pending_sent );
+    if ( l_sent > 0 )
+    {
+      m_pending_sent += l_sent;
+      m_timeout = make_timeout_time_ms( SYNC_TIMEOUT_MS );
+    }
+    tud_vendor_write_flush();
+  }
+  return m_pending_sent >= m_pending_length;
+}
+
+
+/*
+ * queue - adds data to the pending buffer, to be sent to the host.
+ */
+
+static void sync_queue( const void *p_data, uint32_t p_length )
+{
+  memcpy( m_pending + m_pending_length, p_data, p_length );
+  m_pending_length += p_length;
+  return;
+}
+
+
+/*
+ * reply - queues up the response header to the current request.
+ */
+
+static void sync_reply( uint8_t p_status, uint32_t p_data_length )
+{
+  sync_header_t l_reply;
+
+  memset( &l_reply, 0, sizeof( l_reply ) );
+  l_reply.magic = SYNC_MAGIC;
+  l_reply.command = m_request.command;
+  l_reply.status = p_status;
+  l_reply.data_length = p_data_length;
+  sync_queue( &l_reply, sizeof( l_reply ) );
+  return;
+}
+
+
+/*
+ * reset - abandons whatever was in progress, and waits for a fresh request.
+ */
+
+static void sync_reset( void )
+{
+  if ( m_file != NULL )
+  {
+    usbfs_close( m_file );
+    m_file = NULL;
+  }
+  if ( m_state == SYNC_LIST )
+  {
+    f_closedir( &m_dir );
+  }
+  m_state = SYNC_IDLE;
+  m_received = 0;
+  m_pending_length = m_pending_sent = 0;
+  return;
+}
+
+
+/*
+ * list_size - works out how much data a directory listing will take, so that
+ *             it can be given in the reply header; the directory is left
+ *             rewound, ready to be listed for real.
+ */
+
+static uint32_t sync_list_size( void )
+{
+  FILINFO  l_info;
+  uint32_t l_size = 0;
+
+  while( ( f_readdir( &m_dir, &l_info ) == FR_OK ) && ( l_info.fname[0] != '\0' ) )
+  {
+    l_size += sizeof( sync_entry_t ) + strlen( l_info.fname );
+  }
+  f_readdir( &m_dir, NULL );
+  return l_size;
+}
+
+
+/*
+ * start - acts on a request, once the header and pathname have arrived.
+ */
+
+static void sync_start( void )
+{
+  FRESULT l_result;
+
+  switch( m_request.command )
+  {
+    case SYNC_CMD_LIST:
+      l_result = f_opendir( &m_dir, m_name );
+      if ( l_result != FR_OK )
+      {
+        sync_reply( l_result, 0 );
+        m_state = SYNC_IDLE;
+        break;
+      }
+      sync_reply( SYNC_STATUS_OK, sync_list_size() );
+      m_state = SYNC_LIST;
+      break;
+
+    case SYNC_CMD_READ:
+      m_file = usbfs_open( m_name, "r" );
+      if ( m_file == NULL )
+      {
+        sync_reply( FR_NO_FILE, 0 );
+        m_state = SYNC_IDLE;
+        break;
+      }
+      m_remaining = f_size( &m_file->fatfs_fptr );
+      sync_reply( SYNC_STATUS_OK, m_remaining );
+      m_state = SYNC_SEND;
+      break;
+
+    case SYNC_CMD_WRITE:
+      /* Even if we can't open the file, the data has to be received. */
+      m_file = usbfs_open( m_name, "w" );
+      m_status = ( m_file == NULL ) ? FR_DENIED : SYNC_STATUS_OK;
+      m_remaining = m_request.data_length;
+      m_state = SYNC_RECEIVE;
+      break;
+
+    case SYNC_CMD_DELETE:
+      l_result = f_unlink( m_name );
+      if ( l_result == FR_OK )
+      {
+        usb_set_fs_changed();
+      }
+      sync_reply( l_result, 0 );
+      m_state = SYNC_IDLE;
+      break;
+
+    default:
+      sync_reply( SYNC_STATUS_BAD_REQUEST, 0 );
+      m_state = SYNC_IDLE;
+      break;
+  }
+  return;
+}
+
+
+/*
+ * receive - reads incoming request data into the given buffer, until it holds
+ *           the required length; returns true once it does.
+ */
+
+static bool sync_receive( void *p_buffer, uint32_t p_length )
+{
+  uint32_t l_length;
+
+  /* Take whatever has arrived, and remember that the host is still there. */
+  l_length = tud_vendor_read( (uint8_t *)p_buffer + m_received, p_length - m_received );
+  if ( l_length > 0 )
+  {
+    m_received += l_length;
+    m_timeout = make_timeout_time_ms( SYNC_TIMEOUT_MS );
+  }
+  return m_received >= p_length;
+}
+
+
+/*
+ * step - takes the next step with the current request; returns false when
+ *        nothing more can be done until the host catches up.
+ */
+
+static bool sync_step( void )
+{
+  FILINFO       l_info;
+  sync_entry_t  l_entry;
+  uint32_t      l_length;
+
+  switch( m_state )
+  {
+    case SYNC_IDLE:
+      /* Gather up the next request header. */
+      if ( !sync_receive( &m_request, sizeof( m_request ) ) )
+      {
+        return false;
+      }
+      m_received = 0;
+
+      /* If it doesn't make sense, throw away anything else and complain. */
+      if ( ( m_request.magic != SYNC_MAGIC ) || ( m_request.name_length > SYNC_MAX_NAME ) )
+      {
+        tud_vendor_read_flush();
+        sync_reply( SYNC_STATUS_BAD_REQUEST, 0 );
+        return true;
+      }
+      m_state = SYNC_NAME;
+      return true;
+
+    case SYNC_NAME:
+      /* The pathname follows the header. */
+      if ( !sync_receive( m_name, m_request.name_length ) )
+      {
+        return false;
+      }
+      m_name[m_request.name_length] = '\0';
+      m_received = 0;
+      sync_start();
+      return true;
+
+    case SYNC_RECEIVE:
+      /* Write the data to the file as it arrives. */
+      if ( m_remaining > 0 )
+      {
+        l_length = tud_vendor_read( m_pending, ( m_remaining < SYNC_CHUNK ) ? m_remaining : SYNC_CHUNK );
+        if ( l_length == 0 )
+        {
+          return false;
+        }
+        m_remaining -= l_length;
+        if ( ( m_file != NULL ) && ( usbfs_write( m_pending, l_length, m_file ) != l_length ) )
+        {
+          usbfs_close( m_file );
+          m_file = NULL;
+          m_status = FR_DISK_ERR;
+        }
+        return true;
+      }
+
+      /* And once it's all there, tell the host how it went. */
+      if ( ( m_file != NULL ) && !usbfs_close( m_file ) )
+      {
+        m_status = FR_DISK_ERR;
+      }
+      m_file = NULL;
+      sync_reply( m_status, 0 );
+      m_state = SYNC_IDLE;
+      return true;
+
+    case SYNC_SEND:
+      /* 
+       * Send the file a chunk at a time. If it comes up short, the header has
+       * already promised more, so the only honest thing left is to stop; the
+       * host will time out waiting for the rest, and know it failed.
+       */
+      if ( m_remaining > 0 )
+      {
+        l_length = ( m_remaining < SYNC_CHUNK ) ? m_remaining : SYNC_CHUNK;
+        m_pending_length = usbfs_read( m_pending, l_length, m_file );
+        if ( m_pending_length != l_length )
+        {
+          sync_reset();
+          return true;
+        }
+        m_remaining -= l_length;
+        return true;
+      }
+      usbfs_close( m_file );
+      m_file = NULL;
+      m_state = SYNC_IDLE;
+      return true;
+
+    case SYNC_LIST:
+      /* One directory entry at a time, until there are no more. */
+      if ( ( f_readdir( &m_dir, &l_info ) != FR_OK ) || ( l_info.fname[0] == '\0' ) )
+      {
+        f_closedir( &m_dir );
+        m_state = SYNC_IDLE;
+        return true;
+      }
+      memset( &l_entry, 0, sizeof( l_entry ) );
+      l_entry.size = l_info.fsize;
+      l_entry.timestamp = ( l_info.fdate << 16 ) | l_info.ftime;
+      l_entry.attributes = l_info.fattrib;
+      l_entry.name_length = strlen( l_info.fname );
+      sync_queue( &l_entry, sizeof( l_entry ) );
+      sync_queue( l_info.fname, l_entry.name_length );
+      return true;
+  }
+
+  /* We shouldn't get here. */
+  return false;
+}
+
+
+/*
+ * update - keeps the protocol moving; called alongside tud_task(), whenever
+ *          usbfs_update() is (or from the second core, with USBFS_CORE1).
+ */
+
+void sync_update( void )
+{
+  /* If the host isn't listening, drop anything in progress. */
+  if ( !tud_vendor_mounted() )
+  {
+    sync_reset();
+    return;
+  }
+
+  /* Keep going for as long as we're making progress. */
+  while( true )
+  {
+    /* Anything waiting to go to the host has to go first. */
+    if ( !sync_send_pending() )
+    {
+      break;
+    }
+    m_pending_length = m_pending_sent = 0;
+
+    /* Then take the next step, if we can. */
+    if ( !sync_step() )
+    {
+      break;
+    }
+    m_timeout = make_timeout_time_ms( SYNC_TIMEOUT_MS );
+  }
+
+  /* If the host has stopped part way through a request (or reply), give up on it. */
+  if ( ( m_state != SYNC_IDLE || m_received > 0 || m_pending_sent < m_pending_length ) &&
+       time_reached( m_timeout ) )
+  {
+    sync_reset();
+  }
+  return;
+}
+
+#endif /* USBFS_VENDOR */
+
+
+/* End of file usbfs/sync.c */
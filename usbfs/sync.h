@@ -0,0 +1,61 @@
+/*
+ * usbfs/sync.h - part of the PicoW C/C++ Boilerplate Project
+ *
+ * The file-sync protocol spoken over the optional vendor-class USB interface
+ * (see sync.c); this is shared with the host-side tool, so it must not depend
+ * on anything from the Pico SDK.
+ *
+ * Every request from the host starts with a sync_header_t, followed by the
+ * pathname (name_length bytes, without a terminator) and then, for a write,
+ * data_length bytes of file data. Every request is answered with another
+ * sync_header_t, carrying the same command and a status (a FatFS FRESULT, or
+ * SYNC_STATUS_BAD_REQUEST), followed by data_length bytes of data; the file
+ * contents for a read, or a sync_entry_t and name for each directory entry in
+ * a list. All values are little-endian, as on both the RP2040 and most hosts.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+
+/* Constants. */
+
+#define SYNC_MAGIC              0x53465355  /* "USFS" */
+
+#define SYNC_CMD_LIST           0x01
+#define SYNC_CMD_READ           0x02
+#define SYNC_CMD_WRITE          0x03
+#define SYNC_CMD_DELETE         0x04
+
+#define SYNC_STATUS_OK          0x00
+#define SYNC_STATUS_BAD_REQUEST 0xFF
+
+#define SYNC_MAX_NAME           255
+
+
+/* Structures */
+
+typedef struct
+{
+  uint32_t  magic;
+  uint8_t   command;
+  uint8_t   status;
+  uint16_t  name_length;
+  uint32_t  data_length;
+} sync_header_t;
+
+typedef struct
+{
+  uint32_t  size;
+  uint32_t  timestamp;
+  uint8_t   attributes;
+  uint8_t   name_length;
+  uint16_t  reserved;
+} sync_entry_t;
+
+
+/* End of file usbfs/sync.h */
@@ -100,7 +100,13 @@
 #define CFG_TUD_MSC              1
 #define CFG_TUD_HID              0
 #define CFG_TUD_MIDI             0
+
+// The optional file-sync interface (see sync.c)
+#if defined( USBFS_VENDOR ) && USBFS_VENDOR
+#define CFG_TUD_VENDOR           1
+#else
 #define CFG_TUD_VENDOR           0
+#endif
 
 // CDC FIFO size of TX and RX
 #define CFG_TUD_CDC_RX_BUFSIZE   (TUD_OPT_HIGH_SPEED ? 512 : 64)
@@ -112,6 +118,10 @@
 // MSC Buffer size of Device Mass storage
 #define CFG_TUD_MSC_EP_BUFSIZE   512
 
+// Vendor FIFO size of TX and RX
+#define CFG_TUD_VENDOR_RX_BUFSIZE 512
+#define CFG_TUD_VENDOR_TX_BUFSIZE 512
+
 #ifdef __cplusplus
  }
 #endif
@@ -19,28 +19,385 @@
 
 /* Local headers. */
 
+#include "hardware/flash.h"
 #include "tusb.h"
 #include "usbfs.h"
 
 
+/* The cache tracks partial sectors in chunks the size of the endpoint buffer. */
+
+#if CFG_TUD_MSC_EP_BUFSIZE % USBFS_CACHE_CHUNK
+#error "CFG_TUD_MSC_EP_BUFSIZE must be a multiple of USBFS_CACHE_CHUNK"
+#endif
+
+
+/* Constants. */
+
+#define USB_MAP_BYTES(b)    ( ( ( b ) + 31 ) / 32 * sizeof( uint32_t ) )
+
+/* SCSI commands that TinyUSB leaves entirely to us. */
+
+#define USB_SCSI_SYNC_CACHE_10      0x35
+#define USB_SCSI_MODE_SENSE_10      0x5A
+#define USB_SCSI_SYNC_CACHE_16      0x91
+#define USB_SCSI_SERVICE_ACTION_IN  0x9E
+#define USB_SCSI_READ_CAPACITY_16   0x10
+
+#define USB_MODE_PAGE_CACHING       0x08
+#define USB_MODE_PAGE_ALL           0x3F
+#define USB_MODE_PC_CHANGEABLE      0x01
+
+
+/* Structures. */
+
+typedef struct
+{
+  uint32_t        block_count;  /* Blocks covered by the maps below */
+  uint32_t       *host_blocks;
+  uint32_t        host_writes;
+  bool            stale;
+  bool            changed;
+  absolute_time_t quiet_time;
+  absolute_time_t next_signal_time;
+  uint32_t       *watch_blocks;
+  bool            watch_hit;
+  absolute_time_t watch_time;
+} usb_lun_t;
+
+
 /* Module variables. */
 
-static bool     m_mounted = true;
-static bool     m_fs_changed = false;
+static bool       m_mounted = true;
+static usb_lun_t  m_luns[USBFS_PARTITIONS];
+
+#if USBFS_TRACE
+static usb_trace_t  m_trace[USBFS_TRACE];
+static uint32_t     m_trace_count;
+static uint32_t     m_trace_dropped;
+#endif
 
 
 /* Functions.*/
 
 /*
- * usb_set_fs_changed - sets the flag to indicate that a file has been locally
- *                      changed; in turn, this ensures that the host is told
- *                      that a re-scan is required.
+ * host_block - records that the host has seen (and so may be caching) the
+ *              contents of a block.
+ */
+
+static void usb_host_block( uint8_t p_lun, uint32_t p_lba )
+{
+  if ( ( p_lun < USBFS_PARTITIONS ) && ( p_lba < m_luns[p_lun].block_count ) )
+  {
+    m_luns[p_lun].host_blocks[p_lba / 32] |= 1u << ( p_lba % 32 );
+  }
+  return;
+}
+
+
+/*
+ * watch_write - notes a write by the host; if it touches any watched block,
+ *               the watches will be checked once the host has stopped writing
+ *               for a while.
+ */
+
+static void usb_watch_write( uint8_t p_lun, uint32_t p_lba, uint32_t p_offset, uint32_t p_length )
+{
+  usb_lun_t *l_lun = &m_luns[p_lun];
+  uint32_t   l_lba, l_end;
+
+  /* Any write at all puts off the check. */
+  l_lun->watch_time = make_timeout_time_ms( USBFS_WATCH_HOLDOFF_MS );
+  if ( l_lun->watch_blocks == NULL )
+  {
+    return;
+  }
+
+  /* Then see if this one was to anything we're watching. */
+  l_end = p_lba + ( p_offset + p_length + USBFS_BLOCK_SIZE - 1 ) / USBFS_BLOCK_SIZE;
+  for ( l_lba = p_lba; ( l_lba < l_end ) && ( l_lba < l_lun->block_count ); l_lba++ )
+  {
+    if ( l_lun->watch_blocks[l_lba / 32] & ( 1u << ( l_lba % 32 ) ) )
+    {
+      l_lun->watch_hit = true;
+      break;
+    }
+  }
+  return;
+}
+
+
+/*
+ * trace - records a transfer made by the host, for usbfs_dump_trace(). TinyUSB
+ *         hands us each command a buffer at a time, so a transfer carrying on
+ *         directly from the last one is merged into it; this keeps the trace
+ *         down to roughly a record per command.
+ */
+
+static void usb_trace( char p_op, uint8_t p_lun, uint32_t p_lba, 
+                       uint32_t p_offset, uint32_t p_length )
+{
+#if USBFS_TRACE
+  usb_trace_t *l_last;
+
+  /* See if this simply extends the last transfer. */
+  if ( m_trace_count > 0 )
+  {
+    l_last = &m_trace[m_trace_count-1];
+    if ( ( p_op != 'S' ) && ( l_last->op == p_op ) && ( l_last->lun == p_lun ) &&
+         ( l_last->lba * USBFS_BLOCK_SIZE + l_last->offset + l_last->length ==
+           p_lba * USBFS_BLOCK_SIZE + p_offset ) )
+    {
+      l_last->length += p_length;
+      return;
+    }
+  }
+
+  /* If the trace is full, just count what we're missing. */
+  if ( m_trace_count >= USBFS_TRACE )
+  {
+    m_trace_dropped++;
+    return;
+  }
+
+  /* Otherwise, add a new record. */
+  m_trace[m_trace_count].time_ms = time_us_64() / 1000;
+  m_trace[m_trace_count].lba = p_lba;
+  m_trace[m_trace_count].length = p_length;
+  m_trace[m_trace_count].offset = p_offset;
+  m_trace[m_trace_count].lun = p_lun;
+  m_trace[m_trace_count].op = p_op;
+  m_trace_count++;
+#endif
+  return;
+}
+
+
+/*
+ * trace_get - fetches a record from the trace; returns false if there is no
+ *             such record.
+ */
+
+bool usb_trace_get( uint32_t p_index, usb_trace_t *p_record )
+{
+#if USBFS_TRACE
+  if ( p_index < m_trace_count )
+  {
+    *p_record = m_trace[p_index];
+    return true;
+  }
+#endif
+  return false;
+}
+
+
+/*
+ * trace_dropped - returns the number of transfers which didn't fit in the trace.
+ */
+
+uint32_t usb_trace_dropped( void )
+{
+#if USBFS_TRACE
+  return m_trace_dropped;
+#else
+  return 0;
+#endif
+}
+
+
+/*
+ * trace_reset - empties the trace, ready to record afresh.
+ */
+
+void usb_trace_reset( void )
+{
+#if USBFS_TRACE
+  m_trace_count = m_trace_dropped = 0;
+#endif
+  return;
+}
+
+
+/*
+ * init - sizes the block maps for each LUN from its real size, once the
+ *        storage layer knows what that is; if there isn't the RAM for them,
+ *        we do without, and just assume the host has seen every block.
+ */
+
+void usb_init( void )
+{
+  usb_lun_t    *l_lun;
+  uint_fast8_t  l_index;
+  uint16_t      l_block_size;
+  uint32_t      l_block_count;
+
+  for ( l_index = 0; l_index < USBFS_PARTITIONS; l_index++ )
+  {
+    /* Throw away any previous maps. */
+    l_lun = &m_luns[l_index];
+    free( l_lun->host_blocks );
+    free( l_lun->watch_blocks );
+    l_lun->host_blocks = l_lun->watch_blocks = NULL;
+    l_lun->block_count = 0;
+
+    /* And allocate new ones; the watch map is only needed for usbfs_watch(). */
+    storage_get_size( l_index, &l_block_size, &l_block_count );
+    l_lun->host_blocks = (uint32_t *)calloc( 1, USB_MAP_BYTES( l_block_count ) );
+#if USBFS_MAX_WATCHES > 0
+    l_lun->watch_blocks = (uint32_t *)calloc( 1, USB_MAP_BYTES( l_block_count ) );
+#endif
+    l_lun->block_count = l_block_count;
+  }
+
+  /* All done. */
+  return;
+}
+
+
+/*
+ * note_local_write - called whenever blocks are written locally, rather than
+ *                    by the host; if the host has seen any of them, its copy
+ *                    is now stale. Blocks it's never seen don't matter, as it
+ *                    will read the new contents when it needs them.
+ */
+
+void usb_note_local_write( uint8_t p_lun, uint32_t p_lba, uint32_t p_count )
+{
+  uint32_t l_lba;
+
+  /* Sanity check the LUN. */
+  if ( p_lun >= USBFS_PARTITIONS )
+  {
+    return;
+  }
+
+  /* Without a map, we have to assume the host has seen everything. */
+  if ( m_luns[p_lun].host_blocks == NULL )
+  {
+    m_luns[p_lun].stale = true;
+    return;
+  }
+
+  /* Look for any block the host might be holding. */
+  for ( l_lba = p_lba; ( l_lba < p_lba + p_count ) && ( l_lba < m_luns[p_lun].block_count ); l_lba++ )
+  {
+    if ( m_luns[p_lun].host_blocks[l_lba / 32] & ( 1u << ( l_lba % 32 ) ) )
+    {
+      m_luns[p_lun].stale = true;
+      break;
+    }
+  }
+
+  /* All done. */
+  return;
+}
+
+
+/*
+ * usb_host_writes - returns a count of the host's writes to the given LUN; if
+ *                   it hasn't changed since the last call, then the host hasn't
+ *                   written anything in between.
+ */
+
+uint32_t usb_host_writes( uint8_t p_lun )
+{
+  return m_luns[p_lun].host_writes;
+}
+
+
+/*
+ * usb_watch_clear - forgets all the watched blocks on the given LUN, ready for
+ *                   them to be mapped afresh.
+ */
+
+void usb_watch_clear( uint8_t p_lun )
+{
+  if ( m_luns[p_lun].watch_blocks != NULL )
+  {
+    memset( m_luns[p_lun].watch_blocks, 0, USB_MAP_BYTES( m_luns[p_lun].block_count ) );
+  }
+  return;
+}
+
+
+/*
+ * usb_watch_blocks - adds a range of blocks to those watched for host writes.
+ */
+
+void usb_watch_blocks( uint8_t p_lun, uint32_t p_lba, uint32_t p_count )
+{
+  uint32_t l_lba;
+
+  if ( m_luns[p_lun].watch_blocks == NULL )
+  {
+    return;
+  }
+  for ( l_lba = p_lba; ( l_lba < p_lba + p_count ) && ( l_lba < m_luns[p_lun].block_count ); l_lba++ )
+  {
+    m_luns[p_lun].watch_blocks[l_lba / 32] |= 1u << ( l_lba % 32 );
+  }
+  return;
+}
+
+
+/*
+ * usb_watch_triggered - returns true if the host has written to a watched block
+ *                       and has since been quiet for USBFS_WATCH_HOLDOFF_MS;
+ *                       this is only reported once per burst of writes.
+ */
+
+bool usb_watch_triggered( uint8_t p_lun )
+{
+  if ( m_luns[p_lun].watch_hit && time_reached( m_luns[p_lun].watch_time ) )
+  {
+    m_luns[p_lun].watch_hit = false;
+    return true;
+  }
+  return false;
+}
+
+
+/*
+ * usb_watch_next_update - returns when a watch that has been written to will
+ *                         next need checking; if none have, that's never.
+ */
+
+absolute_time_t usb_watch_next_update( void )
+{
+  absolute_time_t l_next = at_the_end_of_time;
+  uint_fast8_t    l_lun;
+
+  for ( l_lun = 0; l_lun < USBFS_PARTITIONS; l_lun++ )
+  {
+    if ( m_luns[l_lun].watch_hit )
+    {
+      l_next = absolute_time_min( l_next, m_luns[l_lun].watch_time );
+    }
+  }
+  return l_next;
+}
+
+
+/*
+ * usb_set_fs_changed - called when a locally modified file has been closed;
+ *                      if the host's view of the filesystem is now stale, it
+ *                      will be told so once things have been quiet for long
+ *                      enough. Repeated changes push this back, so that a
+ *                      burst of them results in a single notification.
  */
 
 void usb_set_fs_changed( void )
 {
-  /* Very simple flag set. */
-  m_fs_changed = true;
+  uint_fast8_t l_lun;
+
+  /* Only the LUNs the host needs to hear about. */
+  for ( l_lun = 0; l_lun < USBFS_PARTITIONS; l_lun++ )
+  {
+    if ( m_luns[l_lun].stale )
+    {
+      m_luns[l_lun].changed = true;
+      m_luns[l_lun].quiet_time = make_timeout_time_ms( USBFS_CHANGE_HOLDOFF_MS );
+    }
+  }
   return;
 }
 
@@ -71,6 +428,18 @@ void tud_umount_cb( void )
 
 /* Mass Storage (MSC) callbacks. */
 
+/*
+ * tud_msc_get_maxlun_cb - Invoked to determine the number of LUNs we present
+ *
+ * Each storage partition is presented as a separate LUN.
+ */
+
+uint8_t tud_msc_get_maxlun_cb( void )
+{
+  return USBFS_PARTITIONS;
+}
+
+
 /*
  * tud_msc_read10_cb - Invoked when received SCSI READ10 command
  *
@@ -91,8 +460,27 @@ int32_t tud_msc_read10_cb( uint8_t p_lun, uint32_t p_lba,
                            uint32_t p_offset, void *p_buffer, 
                            uint32_t p_bufsize )
 {
-  /* We simply pass on this request to the storage layer. */
-  return storage_read( p_lba, p_offset, p_buffer, p_bufsize );
+  int32_t l_bytecount;
+
+  /*
+   * We pass this on to the storage layer; it starts a DMA read from flash and
+   * returns zero, and TinyUSB calls us straight back until the data has
+   * arrived. Sequential reads are mostly answered from the read-ahead buffer.
+   * Virtual files are generated on the spot instead, and never touch flash.
+   */
+#if USBFS_VIRTUAL_FILES > 0
+  l_bytecount = virtual_read( p_lun, p_lba, p_offset, p_buffer, p_bufsize );
+  if ( l_bytecount == 0 )
+#endif
+  l_bytecount = storage_read_async( p_lun, p_lba, p_offset, p_buffer, p_bufsize );
+
+  /* Once the host has the data, it may hang on to it. */
+  if ( l_bytecount > 0 )
+  {
+    usb_host_block( p_lun, p_lba );
+    usb_trace( 'R', p_lun, p_lba, p_offset, l_bytecount );
+  }
+  return l_bytecount;
 }
 
 
@@ -115,8 +503,27 @@ int32_t tud_msc_write10_cb( uint8_t p_lun, uint32_t p_lba,
                             uint32_t p_offset, uint8_t *p_buffer, 
                             uint32_t p_bufsize )
 {
-  /* We simply pass on this request to the storage layer. */
-  return storage_write( p_lba, p_offset, p_buffer, p_bufsize );
+  int32_t l_bytecount;
+
+  /* 
+   * We simply pass on this request to the storage layer; if it's busy writing
+   * to flash it will take the next step of that and return zero, and TinyUSB
+   * will call us again straight away.
+   */
+  l_bytecount = storage_write( p_lun, p_lba, p_offset, p_buffer, p_bufsize );
+
+  /* The host will probably keep its own copy of what it wrote. */
+  if ( l_bytecount > 0 )
+  {
+#if USBFS_VIRTUAL_FILES > 0
+    virtual_write( p_lun, p_lba, p_offset, l_bytecount );
+#endif
+    m_luns[p_lun].host_writes++;
+    usb_watch_write( p_lun, p_lba, p_offset, l_bytecount );
+    usb_host_block( p_lun, p_lba );
+    usb_trace( 'W', p_lun, p_lba, p_offset, l_bytecount );
+  }
+  return l_bytecount;
 }
 
 
@@ -142,18 +549,41 @@ void tud_msc_inquiry_cb( uint8_t p_lun, uint8_t p_vendor_id[8],
 /*
  * tud_msc_test_unit_ready_cb - Invoked when received Test Unit Ready command.
  *
- * If we have made local changes to files, we raise a SENSE_NOT_READY and return
- * false to indicate that the host needs to re-scan. Otherwise, true indicates
- * that all is well.
+ * If we're not mounted, we raise a SENSE_NOT_READY and return false. If we have
+ * made local changes to blocks the host has seen, we raise a UNIT_ATTENTION to
+ * say that the medium may have changed, so that the host re-reads what it needs
+ * without treating the drive as removed. Otherwise, true indicates that all is
+ * well.
  */
 
 bool tud_msc_test_unit_ready_cb( uint8_t p_lun )
 {
-  /* If files have changed locally, or if we're not mounted, we're not ready. */
-  if( m_fs_changed || !m_mounted )
+  usb_lun_t *l_lun;
+
+  /* If we're not mounted, we're not ready. */
+  if( !m_mounted || ( p_lun >= USBFS_PARTITIONS ) )
   {
     tud_msc_set_sense( p_lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00 );
-    m_fs_changed = false;
+    return false;
+  }
+
+  /* 
+   * If files have changed locally, tell the host; but only once they've been
+   * left alone for a while, and not too often.
+   */
+  l_lun = &m_luns[p_lun];
+  if ( l_lun->changed && time_reached( l_lun->quiet_time ) &&
+       time_reached( l_lun->next_signal_time ) )
+  {
+    tud_msc_set_sense( p_lun, SCSI_SENSE_UNIT_ATTENTION, 0x28, 0x00 );
+
+    /* The host will drop everything it has cached, so start afresh. */
+    if ( l_lun->host_blocks != NULL )
+    {
+      memset( l_lun->host_blocks, 0, USB_MAP_BYTES( l_lun->block_count ) );
+    }
+    l_lun->stale = l_lun->changed = false;
+    l_lun->next_signal_time = make_timeout_time_ms( USBFS_CHANGE_INTERVAL_MS );
     return false;
   }
 
@@ -173,11 +603,98 @@ void tud_msc_capacity_cb( uint8_t p_lun,
                           uint32_t *p_block_count, uint16_t *p_block_size )
 {
   /* This is a question for the storage layer. */
-  storage_get_size( p_block_size, p_block_count );
+  storage_get_size( p_lun, p_block_size, p_block_count );
+  return;
+}
+
+
+/*
+ * put_be - stores a value in big-endian order, as SCSI likes it.
+ */
+
+static void usb_put_be( uint8_t *p_buffer, uint64_t p_value, uint_fast8_t p_bytes )
+{
+  while( p_bytes-- > 0 )
+  {
+    p_buffer[p_bytes] = p_value & 0xff;
+    p_value >>= 8;
+  }
   return;
 }
 
 
+/*
+ * mode_sense_10 - builds the response to a MODE SENSE(10) command; the only
+ *                 page we have is the caching page, which tells the host that
+ *                 we have a write cache (and so that it should send SYNCHRONIZE
+ *                 CACHE when it wants data safely in flash). MODE SENSE(6) is
+ *                 answered by TinyUSB itself, with just the header.
+ */
+
+static int32_t usb_mode_sense_10( uint8_t p_lun, uint8_t const p_scsi_cmd[16],
+                                  uint8_t *p_buffer, uint16_t p_bufsize )
+{
+  uint8_t   l_response[8+20];
+  uint8_t   l_page, l_control;
+  uint16_t  l_length;
+
+  /* We only have the caching page, so make sure that's what was asked for. */
+  l_page = p_scsi_cmd[2] & 0x3f;
+  l_control = p_scsi_cmd[2] >> 6;
+  if ( ( l_page != USB_MODE_PAGE_CACHING ) && ( l_page != USB_MODE_PAGE_ALL ) )
+  {
+    tud_msc_set_sense( p_lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x24, 0x00 );
+    return -1;
+  }
+
+  /* The header; no block descriptors, and we're not write protected. */
+  memset( l_response, 0, sizeof( l_response ) );
+  usb_put_be( l_response, sizeof( l_response ) - 2, 2 );
+
+  /* 
+   * And the caching page, with Write Cache Enabled; the host can't change this,
+   * so if it's asking what it can change, the answer is nothing.
+   */
+  l_response[8] = USB_MODE_PAGE_CACHING;
+  l_response[9] = sizeof( l_response ) - 8 - 2;
+  if ( l_control != USB_MODE_PC_CHANGEABLE )
+  {
+    l_response[10] = 0x04;
+  }
+
+  /* Send as much as the host has room for. */
+  l_length = ( sizeof( l_response ) < p_bufsize ) ? sizeof( l_response ) : p_bufsize;
+  memcpy( p_buffer, l_response, l_length );
+  return l_length;
+}
+
+
+/*
+ * read_capacity_16 - builds the response to a READ CAPACITY(16) command; some
+ *                    hosts prefer this to the 10 byte version TinyUSB handles.
+ */
+
+static int32_t usb_read_capacity_16( uint8_t p_lun, uint8_t *p_buffer, uint16_t p_bufsize )
+{
+  uint8_t   l_response[32];
+  uint16_t  l_block_size, l_length;
+  uint32_t  l_block_count;
+
+  /* Ask the storage layer for the size. */
+  storage_get_size( p_lun, &l_block_size, &l_block_count );
+
+  /* The last LBA, and the block size; all else is zero. */
+  memset( l_response, 0, sizeof( l_response ) );
+  usb_put_be( l_response, l_block_count - 1, 8 );
+  usb_put_be( l_response + 8, l_block_size, 4 );
+
+  /* Send as much as the host has room for. */
+  l_length = ( sizeof( l_response ) < p_bufsize ) ? sizeof( l_response ) : p_bufsize;
+  memcpy( p_buffer, l_response, l_length );
+  return l_length;
+}
+
+
 /*
  * tud_msc_scsi_cb - Invoked when receivind a SCSI command not handled by its
  * own callback.
@@ -200,6 +717,35 @@ int32_t tud_msc_scsi_cb( uint8_t p_lun, uint8_t const p_scsi_cmd[16],
       l_retval = 0;
       break;
 
+    /* The host wants everything it has written safely in flash. */
+    case USB_SCSI_SYNC_CACHE_10:
+    case USB_SCSI_SYNC_CACHE_16:
+      usb_trace( 'S', p_lun, 0, 0, 0 );
+      if ( !storage_flush() )
+      {
+        tud_msc_set_sense( p_lun, SCSI_SENSE_MEDIUM_ERROR, 0x0c, 0x00 );
+        l_retval = -1;
+        break;
+      }
+      l_retval = 0;
+      break;
+
+    /* Tell the host about our write cache. */
+    case USB_SCSI_MODE_SENSE_10:
+      l_retval = usb_mode_sense_10( p_lun, p_scsi_cmd, p_buffer, p_bufsize );
+      break;
+
+    /* READ CAPACITY(16) is a service action; it's the only one we support. */
+    case USB_SCSI_SERVICE_ACTION_IN:
+      if ( ( p_scsi_cmd[1] & 0x1f ) == USB_SCSI_READ_CAPACITY_16 )
+      {
+        l_retval = usb_read_capacity_16( p_lun, p_buffer, p_bufsize );
+        break;
+      }
+      tud_msc_set_sense( p_lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x24, 0x00 );
+      l_retval = -1;
+      break;
+
     /* By default, send an ILLEGAL_REQUEST back, and fail. */
     default:
       tud_msc_set_sense( p_lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00 );
@@ -228,6 +774,8 @@ bool tud_msc_start_stop_cb( uint8_t p_lun, uint8_t p_power_condition,
     /* If not starting, we're unloading our drive - flag it as unmounted. */
     if ( !p_start )
     {
+      usb_trace( 'S', p_lun, 0, 0, 0 );
+      storage_flush();
       m_mounted = false;
     }
   }
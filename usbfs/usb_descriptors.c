@@ -83,10 +83,17 @@ enum
   ITF_NUM_CDC = 0,
   ITF_NUM_CDC_DATA,
   ITF_NUM_MSC,
+#if CFG_TUD_VENDOR
+  ITF_NUM_VENDOR,
+#endif
   ITF_NUM_TOTAL
 };
 
+#if CFG_TUD_VENDOR
+#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_MSC_DESC_LEN + TUD_VENDOR_DESC_LEN)
+#else
 #define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_MSC_DESC_LEN)
+#endif
 
 #define EPNUM_CDC_NOTIF   0x81
 #define EPNUM_CDC_OUT     0x02
@@ -95,6 +102,9 @@ enum
 #define EPNUM_MSC_OUT     0x03
 #define EPNUM_MSC_IN      0x83
 
+#define EPNUM_VENDOR_OUT  0x04
+#define EPNUM_VENDOR_IN   0x84
+
 uint8_t const desc_fs_configuration[] =
 {
   // Config number, interface count, string index, total length, attribute, power in mA
@@ -105,6 +115,11 @@ uint8_t const desc_fs_configuration[] =
 
   // Interface number, string index, EP Out & EP In address, EP size
   TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 5, EPNUM_MSC_OUT, EPNUM_MSC_IN, 64),
+
+#if CFG_TUD_VENDOR
+  // Interface number, string index, EP Out & IN address, EP size
+  TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, 6, EPNUM_VENDOR_OUT, EPNUM_VENDOR_IN, 64),
+#endif
 };
 
 
@@ -131,6 +146,7 @@ char const* string_desc_arr [] =
   NULL,                          // 3: Serials, should use chip ID
   USB_PRODUCT_STR" CDC",         // 4: CDC Interface
   USB_PRODUCT_STR" MSC",         // 5: MSC Interface
+  USB_PRODUCT_STR" Sync",        // 6: Vendor (file-sync) Interface
 };
 
 static uint16_t _desc_str[32];
@@ -12,6 +12,7 @@
 
 /* System headers. */
 
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,52 +21,582 @@
 
 /* Local headers. */
 
+#include "pico/stdlib.h"
+#if USBFS_CORE1
+#include "pico/flash.h"
+#include "pico/multicore.h"
+#include "pico/mutex.h"
+#endif
+
+#if PICO_ON_DEVICE
+#include "hardware/structs/scb.h"
+#endif
+
 #include "tusb.h"
 #include "ff.h"
 #include "diskio.h"
 #include "usbfs.h"
 
 
+/* Structures. */
+
+typedef struct
+{
+  usbfs_watch_t callback;
+  char          pathname[USBFS_WATCH_PATH];
+  uint32_t      timestamp;
+  FSIZE_t       size;
+  uint8_t       volume;
+} usbfs_watch_entry_t;
+
+
 /* Module variables. */
 
-static FATFS m_fatfs;
+static FATFS       m_fatfs[USBFS_PARTITIONS];
+static const char *m_labels[] = { UFS_LABEL, UFS_SCRATCH_LABEL };
+
+static uint64_t    m_idle_us;
+static uint64_t    m_idle_since;
+static uint32_t    m_host_writes[USBFS_PARTITIONS];
+
+static usbfs_file_t   m_files[USBFS_MAX_FILES];
+static usbfs_file_t  *m_free_files[USBFS_MAX_FILES];
+static uint_fast8_t   m_free_count;
+static uint32_t       m_files_peak;
+static uint32_t       m_files_exhausted;
+
+#if USBFS_MAX_WATCHES > 0
+static usbfs_watch_entry_t  m_watches[USBFS_MAX_WATCHES];
+#endif
+
+#if USBFS_CORE1
+static recursive_mutex_t  m_lock;
+static volatile bool      m_lock_wanted;
+#endif
 
 
 /* Functions.*/
 
+/*
+ * volume - works out which volume a pathname refers to; FatFS uses a "1:"
+ *          style prefix to select a volume, with no prefix meaning the first.
+ */
+
+static uint8_t usbfs_volume( const char *p_pathname )
+{
+  /* A digit followed by a colon is a volume number. */
+  if ( ( p_pathname[0] >= '0' ) && ( p_pathname[0] < '0' + USBFS_PARTITIONS ) &&
+       ( p_pathname[1] == ':' ) )
+  {
+    return p_pathname[0] - '0';
+  }
+
+  /* Everything else is on the first volume. */
+  return 0;
+}
+
+
+/*
+ * lock - takes ownership of the filesystem; when USB is handled on the second
+ *        core, only one core at a time may be inside FatFS or the storage
+ *        layers. The first core says when it's waiting, so that the second
+ *        can stand aside for it. Without USBFS_CORE1, this does nothing.
+ */
+
+static inline void usbfs_lock( void )
+{
+#if USBFS_CORE1
+  if ( get_core_num() == 0 )
+  {
+    m_lock_wanted = true;
+    recursive_mutex_enter_blocking( &m_lock );
+    m_lock_wanted = false;
+    return;
+  }
+  recursive_mutex_enter_blocking( &m_lock );
+#endif
+  return;
+}
+
+
+/*
+ * unlock - releases ownership of the filesystem, taken by usbfs_lock().
+ */
+
+static inline void usbfs_unlock( void )
+{
+#if USBFS_CORE1
+  recursive_mutex_exit( &m_lock );
+#endif
+  return;
+}
+
+
+/*
+ * refresh - if the host has written to the volume since we last looked, FatFS
+ *           may be holding stale FAT and directory data, so it is re-mounted;
+ *           otherwise, what FatFS has is still good. The filesystem must be
+ *           locked.
+ */
+
+static void usbfs_refresh( uint8_t p_volume )
+{
+  uint32_t  l_host_writes;
+  char      l_drive[3] = "0:";
+
+  l_host_writes = usb_host_writes( p_volume );
+  if ( l_host_writes != m_host_writes[p_volume] )
+  {
+    m_host_writes[p_volume] = l_host_writes;
+    l_drive[0] = '0' + p_volume;
+    f_mount( &m_fatfs[p_volume], l_drive, 1 );
+  }
+  return;
+}
+
+
+/*
+ * file_acquire - takes a file handle from the pool; if they're all in use, NULL
+ *                is returned and errno set to EMFILE, just as fopen() would.
+ *                The filesystem must be locked.
+ */
+
+static usbfs_file_t *usbfs_file_acquire( void )
+{
+  usbfs_file_t *l_fptr;
+
+  /* If there's nothing left in the pool, say so. */
+  if ( m_free_count == 0 )
+  {
+    m_files_exhausted++;
+    errno = EMFILE;
+    return NULL;
+  }
+
+  /* Otherwise, take the most recently released one. */
+  l_fptr = m_free_files[--m_free_count];
+  if ( USBFS_MAX_FILES - m_free_count > m_files_peak )
+  {
+    m_files_peak = USBFS_MAX_FILES - m_free_count;
+  }
+  memset( l_fptr, 0, sizeof( usbfs_file_t ) );
+  l_fptr->in_use = true;
+  return l_fptr;
+}
+
+
+/*
+ * file_in_use - checks that a pointer is one of our file handles, and that it
+ *               is currently in use.
+ */
+
+static bool usbfs_file_in_use( const usbfs_file_t *p_fileptr )
+{
+  return ( p_fileptr >= m_files ) && ( p_fileptr < m_files + USBFS_MAX_FILES ) &&
+         p_fileptr->in_use;
+}
+
+
+/*
+ * file_release - returns a file handle to the pool; anything that isn't a
+ *                handle currently in use is refused. The filesystem must be
+ *                locked.
+ */
+
+static bool usbfs_file_release( usbfs_file_t *p_fileptr )
+{
+  /* Make sure it's one of ours, and that it hasn't already been released. */
+  if ( !usbfs_file_in_use( p_fileptr ) )
+  {
+    return false;
+  }
+
+  /* Then simply put it back. */
+  p_fileptr->in_use = false;
+  m_free_files[m_free_count++] = p_fileptr;
+  return true;
+}
+
+
+/*
+ * wake_on_interrupts - makes sure that any interrupt becoming pending will wake
+ *                      this core from a WFE, even if it arrives just before the
+ *                      WFE itself.
+ */
+
+static void usbfs_wake_on_interrupts( void )
+{
+#if PICO_ON_DEVICE
+  hw_set_bits( &scb_hw->scr, M0PLUS_SCR_SEVONPEND_BITS );
+#endif
+  return;
+}
+
+
+/*
+ * idle - puts the core to sleep until there's something to do; that is, until
+ *        TinyUSB has an event for us, the storage layer needs attention, or the
+ *        given time is reached. Returns the number of microseconds slept.
+ */
+
+static uint64_t usbfs_idle( absolute_time_t p_until )
+{
+  absolute_time_t l_wake;
+  uint64_t        l_start;
+
+  /* If TinyUSB already has work waiting, don't sleep at all. */
+  if ( tud_task_event_ready() )
+  {
+    return 0;
+  }
+
+  /* Wake up in time for the storage layer, if it needs us sooner. */
+  l_wake = absolute_time_min( p_until, storage_next_update() );
+#if !USBFS_CORE1 && USBFS_MAX_WATCHES > 0
+  l_wake = absolute_time_min( l_wake, usb_watch_next_update() );
+#endif
+
+  /*
+   * And wait for an event; the USB interrupt will wake us (SEVONPEND makes
+   * sure one arriving just before we sleep isn't missed), as will the other
+   * core releasing the lock, and failing that the timer will.
+   */
+  l_start = time_us_64();
+  best_effort_wfe_or_timeout( l_wake );
+  return time_us_64() - l_start;
+}
+
+
+#if USBFS_MAX_WATCHES > 0
+
+/*
+ * watch_map - adds the blocks the host would write to when changing a watched
+ *             file to those watched on its volume; that's the directory the
+ *             file lives in (so creating, renaming or deleting it is noticed,
+ *             as is any change to its size or timestamp), and its contents.
+ *             The filesystem must be locked.
+ */
+
+static void usbfs_watch_map( const usbfs_watch_entry_t *p_watch )
+{
+  FATFS        *l_fs = &m_fatfs[p_watch->volume];
+  DIR           l_dir;
+  FILINFO       l_info;
+  usbfs_file_t *l_fptr;
+  FSIZE_t       l_cluster_size, l_offset;
+  char          l_parent[USBFS_WATCH_PATH];
+  char         *l_slash;
+
+  /* Work out the directory the file lives in. */
+  strcpy( l_parent, p_watch->pathname );
+  l_slash = strrchr( l_parent, '/' );
+  if ( l_slash != NULL )
+  {
+    *l_slash = '\0';
+  }
+  else
+  {
+    l_parent[( l_parent[0] != '\0' && l_parent[1] == ':' ) ? 2 : 0] = '\0';
+  }
+
+  /* 
+   * On FAT12/16 the root directory has a fixed place; anything else (including
+   * the FAT32 root, which FatFS opens at its first cluster) is a cluster chain.
+   */
+  if ( f_opendir( &l_dir, l_parent ) == FR_OK )
+  {
+    if ( ( l_dir.obj.sclust == 0 ) && ( l_fs->fs_type != FS_FAT32 ) )
+    {
+      usb_watch_blocks( p_watch->volume, l_fs->dirbase, l_fs->n_rootdir * 32 / FF_MIN_SS );
+    }
+    else
+    {
+      do
+      {
+        usb_watch_blocks( p_watch->volume,
+                          l_fs->database + ( l_dir.clust - 2 ) * l_fs->csize, l_fs->csize );
+      } while( ( f_readdir( &l_dir, &l_info ) == FR_OK ) && ( l_info.fname[0] != '\0' ) );
+    }
+    f_closedir( &l_dir );
+  }
+
+  /* And then each cluster of the file itself, if it's there. */
+  l_fptr = usbfs_file_acquire();
+  if ( l_fptr == NULL )
+  {
+    return;
+  }
+  if ( ( f_open( &l_fptr->fatfs_fptr, p_watch->pathname, FA_READ ) == FR_OK ) &&
+       ( l_fptr->fatfs_fptr.obj.sclust != 0 ) )
+  {
+    l_cluster_size = (FSIZE_t)l_fs->csize * FF_MIN_SS;
+    for ( l_offset = 0; l_offset < f_size( &l_fptr->fatfs_fptr ); l_offset += l_cluster_size )
+    {
+      /* Seeking just into each cluster in turn leaves us looking at it. */
+      if ( f_lseek( &l_fptr->fatfs_fptr, l_offset + 1 ) != FR_OK )
+      {
+        break;
+      }
+      usb_watch_blocks( p_watch->volume,
+                        l_fs->database + ( l_fptr->fatfs_fptr.clust - 2 ) * l_fs->csize,
+                        l_fs->csize );
+    }
+    f_close( &l_fptr->fatfs_fptr );
+  }
+  usbfs_file_release( l_fptr );
+  return;
+}
+
+
+/*
+ * watch_stat - fetches the timestamp and size of a watched file, noting if
+ *              either has changed since the last time. The filesystem must be
+ *              locked.
+ */
+
+static bool usbfs_watch_stat( usbfs_watch_entry_t *p_watch )
+{
+  FILINFO   l_info;
+  uint32_t  l_timestamp = 0;
+  FSIZE_t   l_size = 0;
+  bool      l_changed;
+
+  /* A file that isn't there has no timestamp or size. */
+  if ( f_stat( p_watch->pathname, &l_info ) == FR_OK )
+  {
+    l_timestamp = ( l_info.fdate << 16 ) | l_info.ftime;
+    l_size = l_info.fsize;
+  }
+
+  l_changed = ( l_timestamp != p_watch->timestamp ) || ( l_size != p_watch->size );
+  p_watch->timestamp = l_timestamp;
+  p_watch->size = l_size;
+  return l_changed;
+}
+
+
+/*
+ * watch_remap - rebuilds the watched blocks for a volume, from scratch. The
+ *               filesystem must be locked.
+ */
+
+static void usbfs_watch_remap( uint8_t p_volume )
+{
+  uint_fast8_t l_index;
+
+  usb_watch_clear( p_volume );
+  for ( l_index = 0; l_index < USBFS_MAX_WATCHES; l_index++ )
+  {
+    if ( ( m_watches[l_index].callback != NULL ) && ( m_watches[l_index].volume == p_volume ) )
+    {
+      usbfs_watch_map( &m_watches[l_index] );
+    }
+  }
+  return;
+}
+
+#endif /* USBFS_MAX_WATCHES > 0 */
+
+
+/*
+ * check_watches - once the host has written to a watched file and then gone
+ *                 quiet, looks to see which files really did change and calls
+ *                 their callbacks. The filesystem must *not* be locked, as the
+ *                 callbacks are free to use it.
+ */
+
+static void usbfs_check_watches( void )
+{
+#if USBFS_MAX_WATCHES > 0
+  bool          l_changed[USBFS_MAX_WATCHES];
+  uint_fast8_t  l_volume, l_index;
+
+  for ( l_volume = 0; l_volume < USBFS_PARTITIONS; l_volume++ )
+  {
+    /* Nothing to do unless the host has written to something we're watching. */
+    usbfs_lock();
+    if ( !usb_watch_triggered( l_volume ) )
+    {
+      usbfs_unlock();
+      continue;
+    }
+
+    /* Pick up the host's changes, and see which files are affected. */
+    usbfs_refresh( l_volume );
+    for ( l_index = 0; l_index < USBFS_MAX_WATCHES; l_index++ )
+    {
+      l_changed[l_index] = ( m_watches[l_index].callback != NULL ) &&
+                           ( m_watches[l_index].volume == l_volume ) &&
+                           usbfs_watch_stat( &m_watches[l_index] );
+    }
+
+    /* The files may well have moved, so work out where they are now. */
+    usbfs_watch_remap( l_volume );
+    usbfs_unlock();
+
+    /* And lastly, tell anyone who's interested. */
+    for ( l_index = 0; l_index < USBFS_MAX_WATCHES; l_index++ )
+    {
+      if ( l_changed[l_index] && ( m_watches[l_index].callback != NULL ) )
+      {
+        m_watches[l_index].callback( m_watches[l_index].pathname );
+      }
+    }
+  }
+#endif
+  return;
+}
+
+
+#if USBFS_CORE1
+
+/*
+ * core1_main - the main loop of the second core, when USB is handled there;
+ *              it simply keeps TinyUSB and the storage layer running, taking
+ *              turns with the first core for access to the filesystem. The
+ *              storage layer only takes a single step at a time, so a long
+ *              commit or maintenance burst is broken up between turns.
+ */
+
+static void usbfs_core1_main( void )
+{
+  uint64_t  l_idle_us = 0;
+
+  /* Let the first core park us while it writes to flash. */
+  flash_safe_execute_core_init();
+
+  /* TinyUSB's interrupts need to be handled on this core, so start it here. */
+  usbfs_wake_on_interrupts();
+  tusb_init();
+
+  /* And then just keep things moving. */
+  while( true )
+  {
+    usbfs_lock();
+    m_idle_us += l_idle_us;
+    tud_task();
+#if USBFS_VENDOR
+    sync_update();
+#endif
+    storage_update();
+    usbfs_unlock();
+
+    /*
+     * If the first core is waiting for the filesystem, it goes next; otherwise
+     * we could take the lock straight back, and keep it waiting for as long as
+     * the storage layer has more steps to take.
+     */
+    while( m_lock_wanted )
+    {
+      tight_loop_contents();
+    }
+
+    /*
+     * Sleep until there's more to do, leaving the other core free to work; if
+     * it writes to the cache, releasing the lock will wake us up to notice.
+     */
+    l_idle_us = usbfs_idle( at_the_end_of_time );
+  }
+}
+
+#endif /* USBFS_CORE1 */
+
+
+/*
+ * other_block_size - checks whether a partition that FatFS couldn't mount holds
+ *                    a FAT boot sector for a different block size; that is a
+ *                    real filesystem from a build with another USBFS_BLOCK_SIZE,
+ *                    so it must not be formatted over.
+ */
+
+static bool usbfs_other_block_size( uint8_t p_part, uint8_t *p_buffer )
+{
+  uint32_t l_size;
+
+  /* The boot sector always starts the partition, whatever the block size. */
+  if ( storage_read( p_part, 0, 0, p_buffer, 512 ) != 512 )
+  {
+    return false;
+  }
+
+  /* Look for its signature, and a sector size that isn't ours. */
+  l_size = p_buffer[11] | ( p_buffer[12] << 8 );
+  return ( p_buffer[510] == 0x55 ) && ( p_buffer[511] == 0xAA ) &&
+         ( l_size >= 512 ) && ( l_size <= 4096 ) && ( ( l_size & ( l_size - 1 ) ) == 0 ) &&
+         ( l_size != FF_MIN_SS );
+}
+
+
 /*
  * init - initialised the TinyUSB library, and also the FatFS handling.
  */
 
 void usbfs_init( void )
 {
-  FRESULT   l_result;
-  MKFS_PARM l_options;
+  FRESULT       l_result;
+  MKFS_PARM     l_options;
+  uint_fast8_t  l_part;
+  char          l_drive[3] = "0:";
+  char          l_label[16];
 
+#if !USBFS_CORE1
   /* First order of the day, is TinyUSB. */
+  usbfs_wake_on_interrupts();
   tusb_init();
+#endif
+  m_idle_since = time_us_64();
 
-  /* And also mount our FatFS partition. */
-  l_result = f_mount( &m_fatfs, "", 1 );
+  /* All the file handles start out in the pool. */
+  for ( m_free_count = 0; m_free_count < USBFS_MAX_FILES; m_free_count++ )
+  {
+    m_free_files[m_free_count] = &m_files[USBFS_MAX_FILES - 1 - m_free_count];
+  }
 
-  /* If there was no filesystem, make one. */
-  if ( l_result == FR_NO_FILESYSTEM )
+  /* Then make sure our flash storage is ready for use. */
+  if ( !storage_init() )
   {
-    /* Set up the options, and format. */
-    l_options.fmt = FM_ANY | FM_SFD;
-    l_result = f_mkfs( "", &l_options, m_fatfs.win, FF_MAX_SS );
-    if ( l_result != FR_OK )
-    {
-      return;
-    }
+    return;
+  }
+  usb_init();
 
-    /* Set the label on the volume to something sensible. */
-    f_setlabel( UFS_LABEL );
+  /* And also mount each of our FatFS partitions. */
+  for ( l_part = 0; l_part < USBFS_PARTITIONS; l_part++ )
+  {
+    l_drive[0] = '0' + l_part;
+    l_result = f_mount( &m_fatfs[l_part], l_drive, 1 );
 
-    /* And re-mount. */
-    l_result = f_mount( &m_fatfs, "", 1 );
+    /* If there was no filesystem, make one; unless it's just not one of ours. */
+    if ( ( l_result == FR_NO_FILESYSTEM ) && !usbfs_other_block_size( l_part, m_fatfs[l_part].win ) )
+    {
+      /* Set up the options, and format. */
+      memset( &l_options, 0, sizeof( MKFS_PARM ) );
+      l_options.fmt = FM_ANY | FM_SFD;
+      l_options.au_size = USBFS_CLUSTER_SIZE;
+      l_result = f_mkfs( l_drive, &l_options, m_fatfs[l_part].win, FF_MAX_SS );
+      if ( l_result != FR_OK )
+      {
+        continue;
+      }
+
+      /* Set the label on the volume to something sensible. */
+      snprintf( l_label, sizeof( l_label ), "%s%s", l_drive, m_labels[l_part] );
+      f_setlabel( l_label );
+
+      /* And re-mount. */
+      l_result = f_mount( &m_fatfs[l_part], l_drive, 1 );
+    }
   }
 
+#if USBFS_CORE1
+  /* 
+   * Now hand USB (and the background flash work) over to the second core; we
+   * need to be able to park this core while it writes to flash, too.
+   */
+  recursive_mutex_init( &m_lock );
+  flash_safe_execute_core_init();
+  multicore_launch_core1( usbfs_core1_main );
+#endif
+
   /* All done. */
   return;
 }
@@ -77,8 +608,21 @@ void usbfs_init( void )
 
 void usbfs_update( void )
 {
+#if USBFS_CORE1
+  /* The second core is doing all this for us, except for watched files. */
+#else
   /* Ask TinyUSB to run any outstanding tasks. */
   tud_task();
+#if USBFS_VENDOR
+  sync_update();
+#endif
+
+  /* And let the storage layer flush any idle cached writes. */
+  storage_update();
+#endif
+
+  /* Then tell the application about any files the host has changed. */
+  usbfs_check_watches();
 
   /* All done. */
   return;
@@ -87,22 +631,52 @@ void usbfs_update( void )
 
 /*
  * sleep_ms - a replacement for the standard sleep_ms function; this will
- *            run update in a busy loop until we reach the requested time,
- *            to ensure that TinyUSB doesn't run into trouble.
+ *            run update whenever there's something to do, until we reach the
+ *            requested time, to ensure that TinyUSB doesn't run into trouble.
+ *            In between, the core sleeps until USB or the storage layer need
+ *            attention.
  */
 
 void usbfs_sleep_ms( uint32_t p_milliseconds )
 {
   absolute_time_t l_target_time;
+#if USBFS_CORE1
+  absolute_time_t l_wake_time;
+#endif
+
+#if USBFS_CORE1
+  /*
+   * USB is looked after by the second core, so we can really sleep; we only
+   * need to wake up to tell the application about any changed files.
+   */
+  l_target_time = make_timeout_time_ms( p_milliseconds );
+  while( !time_reached( l_target_time ) )
+  {
+    usbfs_lock();
+    l_wake_time = absolute_time_min( l_target_time, usb_watch_next_update() );
+    usbfs_unlock();
+    sleep_until( l_wake_time );
+    usbfs_check_watches();
+  }
+  return;
+#endif
 
   /* Work out when we want to 'sleep' until. */
   l_target_time = make_timeout_time_ms( p_milliseconds );
 
-  /* Now enter a busy(ish) loop until that time. */
+  /* Now keep things moving until that time. */
   while( !time_reached( l_target_time ) )
   {
     /* Run any updates. */
     tud_task();
+#if USBFS_VENDOR
+    sync_update();
+#endif
+    storage_update();
+    usbfs_check_watches();
+
+    /* And sleep until there's more to do. */
+    m_idle_us += usbfs_idle( l_target_time );
   }
 
   /* All done. */
@@ -152,21 +726,24 @@ usbfs_file_t *usbfs_open( const char *p_pathname, const char *p_mode )
     return NULL;
   }
 
-  /* We'll need a new file structure so save this all in. */
-  l_fptr = (usbfs_file_t *)malloc( sizeof( usbfs_file_t ) );
+  /* We'll need a file structure from the pool to save this all in. */
+  usbfs_lock();
+  l_fptr = usbfs_file_acquire();
   if ( l_fptr == NULL )
   {
+    usbfs_unlock();
     return NULL;
   }
-  memset( l_fptr, 0, sizeof( usbfs_file_t ) );
 
   /* Good, we know the mode so we can just open the file regularly. */
   l_result = f_open( &l_fptr->fatfs_fptr, p_pathname, l_mode );
   if ( l_result != FR_OK )
   {
-    free( l_fptr );
+    usbfs_file_release( l_fptr );
+    usbfs_unlock();
     return NULL;
   }
+  usbfs_unlock();
 
   /* Make sure our status flags are set right, and return our filepointer. */
   l_fptr->modified = false;
@@ -176,19 +753,29 @@ usbfs_file_t *usbfs_open( const char *p_pathname, const char *p_mode )
 
 /*
  * close - closes a file in the FatFS filesystem; if the file has been modified,
- *         it also informs the USB host that this is so.
+ *         it also informs the USB host that this is so. Returns false if the
+ *         file couldn't be closed cleanly (its last writes may not have made
+ *         it to flash), although the handle is freed either way.
  */
 
 bool usbfs_close( usbfs_file_t *p_fileptr )
 {
+  FRESULT l_result;
+
   /* Sanity check the pointer. */
   if ( p_fileptr == NULL )
   {
     return false;
   }
 
-  /* Then simply close the file. */
-  f_close( &p_fileptr->fatfs_fptr );
+  /* Make sure it's an open file, before we touch it. */
+  usbfs_lock();
+  if ( !usbfs_file_in_use( p_fileptr ) )
+  {
+    usbfs_unlock();
+    return false;
+  }
+  l_result = f_close( &p_fileptr->fatfs_fptr );
 
   /* If the file was flagged as modified, let the host know to re-load data. */
   if ( p_fileptr->modified )
@@ -196,11 +783,12 @@ bool usbfs_close( usbfs_file_t *p_fileptr )
     usb_set_fs_changed();
   }
 
-  /* And lastly, free up the memory allocated for our filepointer. */
-  free( p_fileptr );
+  /* Only now can the handle go back to the pool. */
+  usbfs_file_release( p_fileptr );
+  usbfs_unlock();
 
   /* All done. */
-  return true;
+  return l_result == FR_OK;
 }
 
 
@@ -224,7 +812,9 @@ size_t usbfs_read( void *p_buffer, size_t p_size, usbfs_file_t *p_fileptr )
   }
 
   /* Then we just send it to FatFS. */
+  usbfs_lock();
   l_result = f_read( &p_fileptr->fatfs_fptr, p_buffer, p_size, &l_bytecount );
+  usbfs_unlock();
   if ( l_result != FR_OK )
   {
     /* The write has failed. */
@@ -256,7 +846,9 @@ size_t usbfs_write( const void *p_buffer, size_t p_size, usbfs_file_t *p_fileptr
   }
 
   /* Then we just send it to FatFS. */
+  usbfs_lock();
   l_result = f_write( &p_fileptr->fatfs_fptr, p_buffer, p_size, &l_bytecount );
+  usbfs_unlock();
   if ( l_result != FR_OK )
   {
     /* The write has failed. */
@@ -278,6 +870,8 @@ size_t usbfs_write( const void *p_buffer, size_t p_size, usbfs_file_t *p_fileptr
 
 char *usbfs_gets( char *p_buffer, size_t p_size, usbfs_file_t *p_fileptr )
 {
+  char *l_result;
+
   /* Sanity check our parameters. */
   if ( ( p_buffer == NULL ) || ( p_fileptr == NULL ) )
   {
@@ -286,7 +880,10 @@ char *usbfs_gets( char *p_buffer, size_t p_size, usbfs_file_t *p_fileptr )
   }
 
   /* Excellent; so, ask FatFS to do the work. */
-  return f_gets( p_buffer, p_size, &p_fileptr->fatfs_fptr );
+  usbfs_lock();
+  l_result = f_gets( p_buffer, p_size, &p_fileptr->fatfs_fptr );
+  usbfs_unlock();
+  return l_result;
 }
 
 
@@ -307,7 +904,9 @@ size_t usbfs_puts( const char *p_buffer, usbfs_file_t *p_fileptr )
   }
 
   /* Excellent; so, ask FatFS to do the work. */
+  usbfs_lock();
   l_bytecount = f_puts( p_buffer, &p_fileptr->fatfs_fptr );
+  usbfs_unlock();
 
   /* 
    * If a negative value was returned, this indicates an error - otherwise,
@@ -321,6 +920,108 @@ size_t usbfs_puts( const char *p_buffer, usbfs_file_t *p_fileptr )
 }
 
 
+/*
+ * seek - moves the file position, taking the same arguments and providing the
+ *        same returns as the standard 'fseek()' function. Seeking past the end
+ *        of a file opened for writing will extend it; in a file opened only
+ *        for reading, the position stops at the end.
+ */
+
+int usbfs_seek( usbfs_file_t *p_fileptr, long p_offset, int p_whence )
+{
+  FSIZE_t   l_base;
+  FRESULT   l_result;
+
+  /* Sanity check our parameters. */
+  if ( p_fileptr == NULL )
+  {
+    return -1;
+  }
+
+  /* Work out where we're seeking from. */
+  switch( p_whence )
+  {
+    case SEEK_SET:
+      l_base = 0;
+      break;
+    case SEEK_CUR:
+      l_base = f_tell( &p_fileptr->fatfs_fptr );
+      break;
+    case SEEK_END:
+      l_base = f_size( &p_fileptr->fatfs_fptr );
+      break;
+    default:
+      return -1;
+  }
+
+  /* It's not possible to go back before the start of the file. */
+  if ( ( p_offset < 0 ) && ( (FSIZE_t)-p_offset > l_base ) )
+  {
+    return -1;
+  }
+
+  /* And FatFS does the rest; with a link map, without touching the FAT. */
+  usbfs_lock();
+  l_result = f_lseek( &p_fileptr->fatfs_fptr, l_base + p_offset );
+  usbfs_unlock();
+  return ( l_result == FR_OK ) ? 0 : -1;
+}
+
+
+/*
+ * tell - returns the current file position, as the standard 'ftell()' does.
+ */
+
+long usbfs_tell( usbfs_file_t *p_fileptr )
+{
+  /* Sanity check our parameters. */
+  if ( p_fileptr == NULL )
+  {
+    return -1;
+  }
+
+  return f_tell( &p_fileptr->fatfs_fptr );
+}
+
+
+/*
+ * fastseek - builds a cluster link map for a file opened only for reading, so
+ *            that seeking (and reading across clusters) finds each cluster
+ *            straight from the map, instead of following the chain through the
+ *            FAT. This fails if the file is open for writing, or is in more
+ *            fragments than the handle's map can hold; seeking still works
+ *            then, just without the map.
+ */
+
+bool usbfs_fastseek( usbfs_file_t *p_fileptr )
+{
+#if USBFS_LINKMAP_SIZE > 0
+  FRESULT   l_result;
+
+  /* Sanity check our parameters; a link map can't follow a growing file. */
+  if ( ( p_fileptr == NULL ) || ( p_fileptr->fatfs_fptr.flag & FA_WRITE ) )
+  {
+    return false;
+  }
+
+  /* The map is built from the chain in one go, first entry being its size. */
+  usbfs_lock();
+  p_fileptr->linkmap[0] = USBFS_LINKMAP_SIZE;
+  p_fileptr->fatfs_fptr.cltbl = p_fileptr->linkmap;
+  l_result = f_lseek( &p_fileptr->fatfs_fptr, CREATE_LINKMAP );
+  if ( l_result != FR_OK )
+  {
+    /* Too fragmented (or unreadable), so carry on without it. */
+    p_fileptr->fatfs_fptr.cltbl = NULL;
+  }
+  usbfs_unlock();
+  return l_result == FR_OK;
+#else
+  return false;
+#endif
+}
+
+
 /*
  * timestamp - fetches the timestamp of the named file; a zero is returned
  *             if the file does not exist. This is encoded as per FatFS, but
@@ -332,11 +1033,13 @@ uint32_t usbfs_timestamp( const char *p_pathname )
   FILINFO   l_fileinfo;
   FRESULT   l_result;
 
-  /* Force a re-mount to make sure timestamps are sync'd */
-  f_mount( &m_fatfs, "", 1 );
+  /* Make sure that we're seeing any changes the host has made. */
+  usbfs_lock();
+  usbfs_refresh( usbfs_volume( p_pathname ) );
 
   /* Ask for information about the file. */
   l_result = f_stat( p_pathname, &l_fileinfo );
+  usbfs_unlock();
   if ( l_result != FR_OK )
   {
     /* If we encountered an error, return a zero timestamp. */
@@ -348,4 +1051,393 @@ uint32_t usbfs_timestamp( const char *p_pathname )
 }
 
 
+/*
+ * watch - asks for the callback to be called whenever the host changes the
+ *         named file (including creating or deleting it), instead of having
+ *         to poll usbfs_timestamp(). Callbacks are made from usbfs_update()
+ *         or usbfs_sleep_ms(), once the host has finished writing. Passing a
+ *         NULL callback stops watching the file. Returns false if the name is
+ *         too long, or there are already USBFS_MAX_WATCHES files watched.
+ */
+
+bool usbfs_watch( const char *p_pathname, usbfs_watch_t p_callback )
+{
+#if USBFS_MAX_WATCHES > 0
+  usbfs_watch_entry_t *l_watch = NULL;
+  uint_fast8_t         l_index;
+
+  if ( strlen( p_pathname ) >= USBFS_WATCH_PATH )
+  {
+    return false;
+  }
+
+  /* Look for an existing watch on this file, or failing that a free one. */
+  usbfs_lock();
+  for ( l_index = 0; l_index < USBFS_MAX_WATCHES; l_index++ )
+  {
+    if ( ( m_watches[l_index].callback != NULL ) &&
+         ( strcmp( m_watches[l_index].pathname, p_pathname ) == 0 ) )
+    {
+      l_watch = &m_watches[l_index];
+      break;
+    }
+    if ( ( m_watches[l_index].callback == NULL ) && ( l_watch == NULL ) )
+    {
+      l_watch = &m_watches[l_index];
+    }
+  }
+
+  /* Removing a watch that isn't there is fine; running out of room isn't. */
+  if ( ( l_watch == NULL ) || ( ( l_watch->callback == NULL ) && ( p_callback == NULL ) ) )
+  {
+    usbfs_unlock();
+    return p_callback == NULL;
+  }
+
+  /* Note where the file is right now, and what it looks like. */
+  strcpy( l_watch->pathname, p_pathname );
+  l_watch->volume = usbfs_volume( p_pathname );
+  l_watch->callback = p_callback;
+  usbfs_refresh( l_watch->volume );
+  usbfs_watch_stat( l_watch );
+  usbfs_watch_remap( l_watch->volume );
+  usbfs_unlock();
+
+  /* All done. */
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+#if USBFS_VIRTUAL_FILES > 0
+
+/*
+ * contiguous - checks that an open file's clusters follow one another, as
+ *              virtual files need to.
+ */
+
+static bool usbfs_contiguous( FIL *p_file )
+{
+  FSIZE_t l_cluster_size, l_offset;
+  DWORD   l_cluster = p_file->obj.sclust;
+
+  /* Seeking just into each cluster in turn leaves us looking at it. */
+  l_cluster_size = (FSIZE_t)p_file->obj.fs->csize * FF_MIN_SS;
+  for ( l_offset = l_cluster_size; l_offset < f_size( p_file ); l_offset += l_cluster_size )
+  {
+    if ( ( f_lseek( p_file, l_offset + 1 ) != FR_OK ) || ( p_file->clust != ++l_cluster ) )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+#endif
+
+
+/*
+ * add_virtual - adds a read-only file whose content is never stored, but is
+ *               generated by the given function whenever the host reads it.
+ *               The file is always the given size, which can be no more than
+ *               USBFS_VIRTUAL_SIZE; the function is passed a buffer of that
+ *               size to fill, and returns how much it used, the rest being
+ *               padded out with newlines.
+ */
+
+bool usbfs_add_virtual( const char *p_pathname, uint32_t p_size, usbfs_virtual_t p_generator )
+{
+#if USBFS_VIRTUAL_FILES > 0
+  usbfs_file_t *l_fptr;
+  FIL          *l_file;
+  FRESULT       l_result;
+  FATFS        *l_fs;
+  uint32_t      l_lba, l_blocks;
+  bool          l_created = false, l_added;
+
+  /* Sanity check what we've been given. */
+  if ( ( p_size == 0 ) || ( p_size > USBFS_VIRTUAL_SIZE ) || ( p_generator == NULL ) )
+  {
+    return false;
+  }
+
+  /* Borrow a file handle from the pool while we work. */
+  usbfs_lock();
+  l_fptr = usbfs_file_acquire();
+  if ( l_fptr == NULL )
+  {
+    usbfs_unlock();
+    return false;
+  }
+  l_file = &l_fptr->fatfs_fptr;
+
+  /* If the file is already there, the right size and contiguous, use it. */
+  l_result = f_open( l_file, p_pathname, FA_READ );
+  if ( ( l_result != FR_OK ) || ( f_size( l_file ) != p_size ) || !usbfs_contiguous( l_file ) )
+  {
+    /* Otherwise, start again; all we write is the directory entry and FAT. */
+    if ( l_result == FR_OK )
+    {
+      f_close( l_file );
+      f_chmod( p_pathname, 0, AM_RDO );
+      f_unlink( p_pathname );
+    }
+    l_result = f_open( l_file, p_pathname, FA_CREATE_ALWAYS | FA_WRITE );
+    if ( l_result == FR_OK )
+    {
+      l_result = f_expand( l_file, p_size, 1 );
+    }
+    if ( l_result != FR_OK )
+    {
+      f_close( l_file );
+      f_unlink( p_pathname );
+      usbfs_file_release( l_fptr );
+      usbfs_unlock();
+      return false;
+    }
+    l_created = true;
+  }
+
+  /* Work out where its clusters are, and hand them to the virtual layer. */
+  l_fs = l_file->obj.fs;
+  l_lba = l_fs->database + ( l_file->obj.sclust - 2 ) * l_fs->csize;
+  l_blocks = ( p_size + l_fs->csize * FF_MIN_SS - 1 ) / ( l_fs->csize * FF_MIN_SS ) * l_fs->csize;
+  l_added = virtual_add( usbfs_volume( p_pathname ), l_lba, l_blocks, p_size, p_generator );
+  f_close( l_file );
+
+  /* A new file is made read-only, and the host told about it. */
+  if ( l_created )
+  {
+    f_chmod( p_pathname, AM_RDO, AM_RDO );
+    usb_set_fs_changed();
+  }
+
+  /* All done. */
+  usbfs_file_release( l_fptr );
+  usbfs_unlock();
+  return l_added;
+#else
+  return false;
+#endif
+}
+
+
+/*
+ * get_stats - fetches the flash statistics gathered since startup (or since
+ *             they were last reset).
+ */
+
+void usbfs_get_stats( usbfs_stats_t *p_stats )
+{
+  /* Sanity check the pointer. */
+  if ( p_stats == NULL )
+  {
+    return;
+  }
+
+  /* And ask the stats module for a copy, adding in the file handle usage. */
+  usbfs_lock();
+  stats_get( p_stats );
+  p_stats->files_open = USBFS_MAX_FILES - m_free_count;
+  p_stats->files_peak = m_files_peak;
+  p_stats->files_exhausted = m_files_exhausted;
+  usbfs_unlock();
+  return;
+}
+
+
+/*
+ * get_sector_erases - returns the number of times the given sector has been
+ *                     erased; sectors are numbered from the start of the usbfs
+ *                     region of flash.
+ */
+
+uint32_t usbfs_get_sector_erases( uint32_t p_sector )
+{
+  uint32_t l_erases;
+
+  usbfs_lock();
+  l_erases = stats_get_erases( p_sector );
+  usbfs_unlock();
+  return l_erases;
+}
+
+
+/*
+ * reset_stats - zeroes all the flash statistics.
+ */
+
+void usbfs_reset_stats( void )
+{
+  usbfs_lock();
+  stats_reset();
+  m_files_peak = USBFS_MAX_FILES - m_free_count;
+  m_files_exhausted = 0;
+  usbfs_unlock();
+  return;
+}
+
+
+/*
+ * dump_stats - writes the flash statistics out to the named file, as CSV;
+ *              note that writing the file itself causes flash writes, which
+ *              may show up in the per-sector counts written near the end.
+ */
+
+bool usbfs_dump_stats( const char *p_pathname )
+{
+  usbfs_stats_t l_stats;
+  usbfs_file_t *l_fileptr;
+  char          l_buffer[64];
+  uint32_t      l_index, l_erases;
+
+  /* Take a copy of the stats first, so that writing doesn't disturb them. */
+  usbfs_get_stats( &l_stats );
+
+  /* Open up the file (if we can) */
+  l_fileptr = usbfs_open( p_pathname, "w" );
+  if ( l_fileptr == NULL )
+  {
+    return false;
+  }
+
+  /* The totals come first. */
+  snprintf( l_buffer, sizeof( l_buffer ), "erases,%lu\n", (unsigned long)l_stats.erases );
+  usbfs_puts( l_buffer, l_fileptr );
+  snprintf( l_buffer, sizeof( l_buffer ), "programs,%lu\n", (unsigned long)l_stats.programs );
+  usbfs_puts( l_buffer, l_fileptr );
+  snprintf( l_buffer, sizeof( l_buffer ), "programmed_bytes,%llu\n", (unsigned long long)l_stats.programmed_bytes );
+  usbfs_puts( l_buffer, l_fileptr );
+  snprintf( l_buffer, sizeof( l_buffer ), "reads,%lu\n", (unsigned long)l_stats.reads );
+  usbfs_puts( l_buffer, l_fileptr );
+  snprintf( l_buffer, sizeof( l_buffer ), "read_bytes,%llu\n", (unsigned long long)l_stats.read_bytes );
+  usbfs_puts( l_buffer, l_fileptr );
+  snprintf( l_buffer, sizeof( l_buffer ), "irq_off_max_us,%lu\n", (unsigned long)l_stats.irq_off_max_us );
+  usbfs_puts( l_buffer, l_fileptr );
+  snprintf( l_buffer, sizeof( l_buffer ), "files_peak,%lu\n", (unsigned long)l_stats.files_peak );
+  usbfs_puts( l_buffer, l_fileptr );
+  snprintf( l_buffer, sizeof( l_buffer ), "files_exhausted,%lu\n", (unsigned long)l_stats.files_exhausted );
+  usbfs_puts( l_buffer, l_fileptr );
+
+  /* Then the histogram, labelled with the lower bound of each bucket. */
+  for ( l_index = 0; l_index < USBFS_STATS_BUCKETS; l_index++ )
+  {
+    snprintf( l_buffer, sizeof( l_buffer ), "irq_off_us,%lu,%lu\n", 
+              l_index ? 1ul << l_index : 0ul, (unsigned long)l_stats.irq_off_histogram[l_index] );
+    usbfs_puts( l_buffer, l_fileptr );
+  }
+
+  /* And lastly the erase count of every sector that's been erased at all. */
+  for ( l_index = 0; l_index < l_stats.sectors; l_index++ )
+  {
+    l_erases = usbfs_get_sector_erases( l_index );
+    if ( l_erases > 0 )
+    {
+      snprintf( l_buffer, sizeof( l_buffer ), "sector_erases,%lu,%lu\n", 
+                (unsigned long)l_index, (unsigned long)l_erases );
+      usbfs_puts( l_buffer, l_fileptr );
+    }
+  }
+
+  /* All done. */
+  return usbfs_close( l_fileptr );
+}
+
+
+/*
+ * dump_trace - writes the transfers recorded from the host out to the named
+ *              file, as CSV, and then starts a fresh trace. Each line gives the
+ *              operation (R for a read, W for a write, S for a cache sync),
+ *              the time in milliseconds, the LUN, the first logical block, the
+ *              byte offset into it and the length in bytes. usbfs_replay, in
+ *              the host build, can play these back against the storage layer.
+ *
+ *              This requires USBFS_TRACE to be set to the number of records to
+ *              keep; otherwise, there is nothing to write and false is returned.
+ */
+
+bool usbfs_dump_trace( const char *p_pathname )
+{
+#if USBFS_TRACE
+  usb_trace_t   l_record;
+  usbfs_file_t *l_fileptr;
+  char          l_buffer[64];
+  uint32_t      l_index;
+  bool          l_found;
+
+  /* Open up the file (if we can) */
+  l_fileptr = usbfs_open( p_pathname, "w" );
+  if ( l_fileptr == NULL )
+  {
+    return false;
+  }
+
+  /* Replaying needs to know the block size, and if anything is missing. */
+  snprintf( l_buffer, sizeof( l_buffer ), "block_size,%u\n", USBFS_BLOCK_SIZE );
+  usbfs_puts( l_buffer, l_fileptr );
+  usbfs_lock();
+  snprintf( l_buffer, sizeof( l_buffer ), "dropped,%lu\n", (unsigned long)usb_trace_dropped() );
+  usbfs_unlock();
+  usbfs_puts( l_buffer, l_fileptr );
+
+  /* Then each record in turn; the host may still be adding to them. */
+  for ( l_index = 0; ; l_index++ )
+  {
+    usbfs_lock();
+    l_found = usb_trace_get( l_index, &l_record );
+    usbfs_unlock();
+    if ( !l_found )
+    {
+      break;
+    }
+    snprintf( l_buffer, sizeof( l_buffer ), "%c,%lu,%u,%lu,%u,%lu\n", 
+              l_record.op, (unsigned long)l_record.time_ms, l_record.lun,
+              (unsigned long)l_record.lba, l_record.offset, (unsigned long)l_record.length );
+    usbfs_puts( l_buffer, l_fileptr );
+  }
+
+  /* Start afresh, so that the next dump only has what happens from here. */
+  usbfs_lock();
+  usb_trace_reset();
+  usbfs_unlock();
+
+  /* All done. */
+  return usbfs_close( l_fileptr );
+#else
+  return false;
+#endif
+}
+
+
+/*
+ * idle_percent - returns the percentage of time since the last call (or since
+ *                startup) that usbfs spent asleep, waiting for something to do;
+ *                that is, within usbfs_sleep_ms() or, with USBFS_CORE1, on the
+ *                second core.
+ */
+
+uint8_t usbfs_idle_percent( void )
+{
+  uint64_t  l_now, l_elapsed, l_idle;
+
+  /* Grab the figures, and start counting afresh. */
+  usbfs_lock();
+  l_now = time_us_64();
+  l_elapsed = l_now - m_idle_since;
+  l_idle = m_idle_us;
+  m_idle_since = l_now;
+  m_idle_us = 0;
+  usbfs_unlock();
+
+  /* And work out the percentage. */
+  if ( l_elapsed == 0 )
+  {
+    return 0;
+  }
+  return ( l_idle >= l_elapsed ) ? 100 : l_idle * 100 / l_elapsed;
+}
+
+
 /* End of file usbfs/usbfs.cpp */
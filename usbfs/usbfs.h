@@ -11,6 +11,7 @@
 
 #pragma once
 
+#include "pico/stdlib.h"
 #include "ff.h"
 
 
@@ -21,14 +22,169 @@
 #define USB_PRODUCT_STR     "PicoW"
 
 #define UFS_LABEL           "PicoW"
+#define UFS_SCRATCH_LABEL   "SCRATCH"
+
+#define USBFS_STATS_BUCKETS 20      /* Histogram buckets, 1us to 524ms+ */
+
+/* Storage tuning; these may be overridden at build time. */
+
+#ifndef USBFS_STORAGE_SECTORS
+#define USBFS_STORAGE_SECTORS 128   /* Size of the filesystem, in 4kb sectors */
+#endif
+#ifndef USBFS_STORAGE_OFFSET
+#define USBFS_STORAGE_OFFSET  0     /* Start of storage in flash; 0 for the end */
+#endif
+#ifndef USBFS_SCRATCH_SECTORS
+#define USBFS_SCRATCH_SECTORS 0     /* Size of the scratch filesystem, if any */
+#endif
+
+#if USBFS_SCRATCH_SECTORS > 0
+#define USBFS_PARTITIONS    2
+#else
+#define USBFS_PARTITIONS    1
+#endif
+
+#if FF_VOLUMES != USBFS_PARTITIONS
+#error "FatFS volume count does not match the usbfs partition count"
+#endif
+
+#ifndef USBFS_BLOCK_SIZE
+#define USBFS_BLOCK_SIZE    4096    /* Logical block size seen by the host and FatFS */
+#endif
+
+#if ( USBFS_BLOCK_SIZE != 512 ) && ( USBFS_BLOCK_SIZE != 1024 ) && \
+    ( USBFS_BLOCK_SIZE != 2048 ) && ( USBFS_BLOCK_SIZE != 4096 )
+#error "USBFS_BLOCK_SIZE must be 512, 1024, 2048 or 4096"
+#endif
+#if FF_MIN_SS != USBFS_BLOCK_SIZE
+#error "FatFS sector size does not match USBFS_BLOCK_SIZE"
+#endif
+
+#ifndef USBFS_CACHE_SECTORS
+#define USBFS_CACHE_SECTORS 2       /* Number of 4kb sectors cached in RAM */
+#endif
+#ifndef USBFS_CACHE_CHUNK
+#define USBFS_CACHE_CHUNK   512     /* Partial write size; the MSC endpoint buffer */
+#endif
+#ifndef USBFS_CACHE_IDLE_MS
+#define USBFS_CACHE_IDLE_MS 1000    /* Idle time before the cache is flushed */
+#endif
+#ifndef USBFS_FLASH_COMPARE
+#define USBFS_FLASH_COMPARE 1       /* Skip erase/program of unchanged data */
+#endif
+#ifndef USBFS_PROGRAM_PAGES
+#define USBFS_PROGRAM_PAGES 16      /* Most pages programmed in a single step */
+#endif
+#ifndef USBFS_BLOCK_ERASE
+#define USBFS_BLOCK_ERASE   1       /* Use 64kb block erases for large writes */
+#endif
+#ifndef USBFS_CLUSTER_SIZE
+#define USBFS_CLUSTER_SIZE  4096    /* Cluster size for new filesystems; 0 for auto */
+#endif
+#ifndef USBFS_READAHEAD
+#define USBFS_READAHEAD     1       /* Prefetch sectors for sequential host reads */
+#endif
+#ifndef USBFS_HOT_SECTORS
+#define USBFS_HOT_SECTORS   0       /* Leading sectors read via the XIP cache */
+#endif
+#ifndef USBFS_CORE1
+#define USBFS_CORE1         0       /* Run USB and flash work on the second core */
+#endif
+#if USBFS_CORE1 && LIB_PICO_STDIO_USB
+#error "USBFS_CORE1 can't be used with USB stdio, which runs TinyUSB from the first core"
+#endif
+#ifndef USBFS_FLASH_TIMEOUT_MS
+#define USBFS_FLASH_TIMEOUT_MS 100  /* How long to wait for the other core */
+#endif
+#ifndef USBFS_CHANGE_HOLDOFF_MS
+#define USBFS_CHANGE_HOLDOFF_MS  500  /* Quiet time before the host is told of changes */
+#endif
+#ifndef USBFS_CHANGE_INTERVAL_MS
+#define USBFS_CHANGE_INTERVAL_MS 2000 /* Shortest time between change notifications */
+#endif
+#ifndef USBFS_MAX_WATCHES
+#define USBFS_MAX_WATCHES   4       /* Most files watched by usbfs_watch() */
+#endif
+#ifndef USBFS_WATCH_PATH
+#define USBFS_WATCH_PATH    64      /* Longest pathname that can be watched */
+#endif
+#ifndef USBFS_WATCH_HOLDOFF_MS
+#define USBFS_WATCH_HOLDOFF_MS 250  /* Quiet time before host writes are checked */
+#endif
+#ifndef USBFS_TRACE
+#define USBFS_TRACE         0       /* MSC transfers recorded for usbfs_dump_trace() */
+#endif
+#ifndef USBFS_MAX_FILES
+#define USBFS_MAX_FILES     4       /* Most files open at once, via usbfs_open() */
+#endif
+#ifndef USBFS_LINKMAP_SIZE
+#define USBFS_LINKMAP_SIZE  16      /* DWORDs of fast-seek link map in each handle */
+#endif
+#ifndef USBFS_TINY
+#define USBFS_TINY          0       /* Share the filesystem window between files */
+#endif
+#if FF_FS_TINY != USBFS_TINY
+#error "FatFS tiny mode does not match USBFS_TINY"
+#endif
+#ifndef USBFS_VIRTUAL_FILES
+#define USBFS_VIRTUAL_FILES 0       /* Most files added by usbfs_add_virtual() */
+#endif
+#ifndef USBFS_VIRTUAL_SIZE
+#define USBFS_VIRTUAL_SIZE  1024    /* Largest virtual file, held in RAM when read */
+#endif
+#ifndef USBFS_VENDOR
+#define USBFS_VENDOR        0       /* Add a vendor-class file-sync interface */
+#endif
+#ifndef USBFS_WEAR_LEVEL
+#define USBFS_WEAR_LEVEL    1       /* Spread erases across spare sectors */
+#endif
+#ifndef USBFS_WL_SPARES
+#define USBFS_WL_SPARES     4       /* Number of spare sectors to rotate through */
+#endif
+
+#if USBFS_WEAR_LEVEL && ( USBFS_WL_SPARES < 1 )
+#error "Wear levelling requires at least one spare sector"
+#endif
 
 
 /* Structures */
 
+typedef struct
+{
+  uint32_t  sectors;
+  uint32_t  erases;
+  uint32_t  programs;
+  uint32_t  reads;
+  uint64_t  programmed_bytes;
+  uint64_t  read_bytes;
+  uint32_t  irq_off_max_us;
+  uint32_t  irq_off_histogram[USBFS_STATS_BUCKETS];
+  uint32_t  files_open;
+  uint32_t  files_peak;
+  uint32_t  files_exhausted;
+} usbfs_stats_t;
+
+typedef struct
+{
+  uint32_t  time_ms;
+  uint32_t  lba;
+  uint32_t  length;
+  uint16_t  offset;
+  uint8_t   lun;
+  char      op;
+} usb_trace_t;
+
+typedef uint32_t (*usbfs_virtual_t)( char *, uint32_t );
+typedef void     (*usbfs_watch_t)( const char * );
+
 typedef struct
 {
   FIL   fatfs_fptr;
   bool  modified;
+  bool  in_use;
+#if USBFS_LINKMAP_SIZE > 0
+  DWORD linkmap[USBFS_LINKMAP_SIZE];
+#endif
 } usbfs_file_t;
 
 
@@ -36,11 +192,61 @@ typedef struct
 
 /* Internal functions. */
 
-void            storage_get_size( uint16_t *, uint32_t * );
-int32_t         storage_read( uint32_t, uint32_t, void *, uint32_t );
-int32_t         storage_write( uint32_t, uint32_t, const uint8_t *, uint32_t );
+void            flashio_init( uint32_t, uint32_t );
+uint32_t        flashio_get_free( void );
+uint32_t        flashio_get_size( void );
+void            flashio_read( uint32_t, void *, uint32_t );
+bool            flashio_read_start( uint32_t, void *, uint32_t );
+bool            flashio_read_busy( void );
+void            flashio_read_cached( uint32_t, void *, uint32_t );
+bool            flashio_erase( uint32_t );
+uint32_t        flashio_block_offset( uint32_t );
+bool            flashio_erase_block( uint32_t );
+bool            flashio_program( uint32_t, const void *, uint32_t );
+
+bool            wl_init( uint8_t, uint32_t, uint32_t );
+uint32_t        wl_get_overhead( uint32_t );
+uint32_t        wl_address( uint8_t, uint32_t );
+uint32_t        wl_relocate( uint8_t, bool * );
+bool            wl_commit( uint8_t, uint32_t, uint32_t, bool * );
+bool            wl_maintain( void );
+
+void            stats_init( uint32_t );
+void            stats_erase( uint32_t, uint32_t, uint32_t );
+void            stats_program( uint32_t, uint32_t );
+void            stats_read( uint32_t );
+void            stats_get( usbfs_stats_t * );
+uint32_t        stats_get_erases( uint32_t );
+void            stats_reset( void );
+
+bool            storage_init( void );
+void            storage_get_size( uint8_t, uint16_t *, uint32_t * );
+int32_t         storage_read( uint8_t, uint32_t, uint32_t, void *, uint32_t );
+int32_t         storage_read_async( uint8_t, uint32_t, uint32_t, void *, uint32_t );
+int32_t         storage_write( uint8_t, uint32_t, uint32_t, const uint8_t *, uint32_t );
+int32_t         storage_write_bulk( uint8_t, uint32_t, uint32_t, const uint8_t *, uint32_t );
+bool            storage_flush( void );
+void            storage_update( void );
+bool            storage_busy( void );
+absolute_time_t storage_next_update( void );
 
+void            usb_init( void );
+void            usb_note_local_write( uint8_t, uint32_t, uint32_t );
+uint32_t        usb_host_writes( uint8_t );
+void            usb_watch_clear( uint8_t );
+void            usb_watch_blocks( uint8_t, uint32_t, uint32_t );
+bool            usb_watch_triggered( uint8_t );
+absolute_time_t usb_watch_next_update( void );
 void            usb_set_fs_changed( void );
+bool            usb_trace_get( uint32_t, usb_trace_t * );
+uint32_t        usb_trace_dropped( void );
+void            usb_trace_reset( void );
+
+void            sync_update( void );
+
+bool            virtual_add( uint8_t, uint32_t, uint32_t, uint32_t, usbfs_virtual_t );
+uint32_t        virtual_read( uint8_t, uint32_t, uint32_t, void *, uint32_t );
+void            virtual_write( uint8_t, uint32_t, uint32_t, uint32_t );
 
 /* Public functions. */
 
@@ -58,7 +264,19 @@ size_t          usbfs_read( void *, size_t, usbfs_file_t * );
 size_t          usbfs_write( const void *, size_t, usbfs_file_t * );
 char           *usbfs_gets( char *, size_t, usbfs_file_t * );
 size_t          usbfs_puts( const char *, usbfs_file_t * );
+int             usbfs_seek( usbfs_file_t *, long, int );
+long            usbfs_tell( usbfs_file_t * );
+bool            usbfs_fastseek( usbfs_file_t * );
 uint32_t        usbfs_timestamp( const char * );
+bool            usbfs_add_virtual( const char *, uint32_t, usbfs_virtual_t );
+bool            usbfs_watch( const char *, usbfs_watch_t );
+
+void            usbfs_get_stats( usbfs_stats_t * );
+uint32_t        usbfs_get_sector_erases( uint32_t );
+void            usbfs_reset_stats( void );
+bool            usbfs_dump_stats( const char * );
+bool            usbfs_dump_trace( const char * );
+uint8_t         usbfs_idle_percent( void );
 
 #ifdef __cplusplus
 }
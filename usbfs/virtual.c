@@ -0,0 +1,206 @@
+/*
+ * usbfs/virtual.c - part of the PicoW C/C++ Boilerplate Project
+ *
+ * Virtual files are real, read-only files in the FAT whose clusters are never
+ * written to; when the host reads those clusters, the content is generated on
+ * the spot by a function provided by the application. This lets a program
+ * publish live information (status, statistics and so on) without erasing or
+ * programming any flash, and without telling the host that the drive changed.
+ *
+ * The files themselves are set up by usbfs_add_virtual(); this just keeps track
+ * of where they live and answers the host's reads.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+/* System headers. */
+
+#include <string.h>
+
+
+/* Local headers. */
+
+#include "usbfs.h"
+
+
+#if USBFS_VIRTUAL_FILES > 0
+
+/* Structures. */
+
+typedef struct
+{
+  usbfs_virtual_t generator;
+  uint32_t        start;        /* Byte address of the first cluster */
+  uint32_t        length;       /* Bytes allocated to the file */
+  uint32_t        size;         /* Bytes of content */
+  uint8_t         lun;
+  bool            active;
+} virtual_file_t;
+
+
+/* Module variables. */
+
+static virtual_file_t m_files[USBFS_VIRTUAL_FILES];
+static char           m_content[USBFS_VIRTUAL_SIZE];
+static int_fast8_t    m_current = -1;
+
+
+/* Functions.*/
+
+/*
+ * find - looks for the virtual file containing the given address, returning
+ *        its index or -1 if there isn't one.
+ */
+
+static int_fast8_t virtual_find( uint8_t p_lun, uint32_t p_address )
+{
+  int_fast8_t l_index;
+
+  for ( l_index = 0; l_index < USBFS_VIRTUAL_FILES; l_index++ )
+  {
+    if ( m_files[l_index].active && ( m_files[l_index].lun == p_lun ) &&
+         ( p_address >= m_files[l_index].start ) &&
+         ( p_address < m_files[l_index].start + m_files[l_index].length ) )
+    {
+      return l_index;
+    }
+  }
+
+  /* Not a virtual file, then. */
+  return -1;
+}
+
+
+/*
+ * add - registers a virtual file, occupying the given range of blocks; if a
+ *       virtual file already starts at that block, it is replaced.
+ */
+
+bool virtual_add( uint8_t p_lun, uint32_t p_lba, uint32_t p_blocks,
+                  uint32_t p_size, usbfs_virtual_t p_generator )
+{
+  int_fast8_t l_index, l_free = -1;
+
+  /* Look for the existing entry, or a free one. */
+  for ( l_index = 0; l_index < USBFS_VIRTUAL_FILES; l_index++ )
+  {
+    if ( m_files[l_index].active && ( m_files[l_index].lun == p_lun ) &&
+         ( m_files[l_index].start == p_lba * USBFS_BLOCK_SIZE ) )
+    {
+      l_free = l_index;
+      break;
+    }
+    if ( !m_files[l_index].active && ( l_free < 0 ) )
+    {
+      l_free = l_index;
+    }
+  }
+  if ( l_free < 0 )
+  {
+    return false;
+  }
+
+  /* Fill it in; any content we were holding for it is now out of date. */
+  m_files[l_free].generator = p_generator;
+  m_files[l_free].start = p_lba * USBFS_BLOCK_SIZE;
+  m_files[l_free].length = p_blocks * USBFS_BLOCK_SIZE;
+  m_files[l_free].size = p_size;
+  m_files[l_free].lun = p_lun;
+  m_files[l_free].active = true;
+  if ( m_current == l_free )
+  {
+    m_current = -1;
+  }
+
+  /* All done. */
+  return true;
+}
+
+
+/*
+ * read - provides the content of a virtual file, if the host is reading from
+ *        one; returns the number of bytes provided, or zero if the address is
+ *        not within a virtual file (so it should be read from storage).
+ */
+
+uint32_t virtual_read( uint8_t p_lun, uint32_t p_lba, uint32_t p_offset,
+                       void *p_buffer, uint32_t p_length )
+{
+  virtual_file_t *l_file;
+  int_fast8_t     l_index;
+  uint32_t        l_position, l_generated;
+
+  /* See if this is part of a virtual file at all. */
+  l_index = virtual_find( p_lun, p_lba * USBFS_BLOCK_SIZE + p_offset );
+  if ( l_index < 0 )
+  {
+    return 0;
+  }
+  l_file = &m_files[l_index];
+  l_position = p_lba * USBFS_BLOCK_SIZE + p_offset - l_file->start;
+
+  /*
+   * The host reads files from the start, so that's when the content is
+   * generated; everything it then reads comes from the same snapshot. The
+   * content is padded out to the file size with newlines.
+   */
+  if ( ( l_position == 0 ) || ( m_current != l_index ) )
+  {
+    l_generated = l_file->generator( m_content, l_file->size );
+    if ( l_generated < l_file->size )
+    {
+      memset( m_content + l_generated, '\n', l_file->size - l_generated );
+    }
+    m_current = l_index;
+  }
+
+  /* Don't go past the end of the file's clusters... */
+  if ( p_length > l_file->length - l_position )
+  {
+    p_length = l_file->length - l_position;
+  }
+
+  /* ...and beyond the content, the cluster is just padding. */
+  memset( p_buffer, 0, p_length );
+  if ( l_position < l_file->size )
+  {
+    memcpy( p_buffer, m_content + l_position,
+            ( p_length < l_file->size - l_position ) ? p_length : l_file->size - l_position );
+  }
+  return p_length;
+}
+
+
+/*
+ * write - notes that the host, or FatFS on the device, is writing to storage;
+ *         if it touches a virtual file, the file has either been overwritten
+ *         or deleted and its clusters reused, so from then on the clusters are
+ *         treated normally.
+ */
+
+void virtual_write( uint8_t p_lun, uint32_t p_lba, uint32_t p_offset, uint32_t p_length )
+{
+  uint32_t    l_address = p_lba * USBFS_BLOCK_SIZE + p_offset;
+  int_fast8_t l_index;
+
+  for ( l_index = 0; l_index < USBFS_VIRTUAL_FILES; l_index++ )
+  {
+    if ( m_files[l_index].active && ( m_files[l_index].lun == p_lun ) &&
+         ( l_address < m_files[l_index].start + m_files[l_index].length ) &&
+         ( l_address + p_length > m_files[l_index].start ) )
+    {
+      m_files[l_index].active = false;
+      if ( m_current == l_index )
+      {
+        m_current = -1;
+      }
+    }
+  }
+  return;
+}
+
+#endif /* USBFS_VIRTUAL_FILES > 0 */
+
+
+/* End of file usbfs/virtual.c */
@@ -0,0 +1,594 @@
+/*
+ * usbfs/wearlevel.c - part of the PicoW C/C++ Boilerplate Project
+ *
+ * A simple wear levelling layer, which sits between the storage layer and the
+ * flash. Rather than always erasing a logical sector in place, a rewritten
+ * sector is moved to whichever pre-erased spare sector has seen the fewest
+ * erases, and the sector it came from becomes a spare in turn.
+ *
+ * Each partition is levelled separately; its area of flash is laid out as:
+ *
+ *   [ bank 0 ][ bank 1 ][ spare sectors ][ logical sectors ]
+ *
+ * so that, before anything has been moved, every logical sector sits exactly
+ * where it did without wear levelling. Each bank holds a snapshot of the full
+ * logical-to-physical map and the erase count of each physical sector, followed
+ * by a journal of individual remappings. When the journal fills, a new snapshot
+ * is written to the other bank, a sector erase or a few pages at a time like
+ * any other commit; on startup, the newest valid bank wins.
+ *
+ * Copyright (C) 2023 Pete Favelle <ahnlak@ahnlak.com>
+ * This file is released under the BSD 3-Clause License; see LICENSE for details.
+ */
+
+/* System headers. */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hardware/flash.h"
+
+
+/* Local headers. */
+
+#include "usbfs.h"
+
+
+/* Constants. */
+
+#define WL_MAGIC              0x4c574655    /* 'UFWL' */
+#define WL_JOURNAL_MIN        64            /* Smallest journal we'll accept */
+
+#define WL_SECTOR_MAPPED      0
+#define WL_SECTOR_ERASED      1
+#define WL_SECTOR_STALE       2
+#define WL_SECTOR_RESERVED    3
+
+
+/* Structures. */
+
+typedef struct
+{
+  uint32_t  magic;
+  uint32_t  sequence;
+  uint16_t  logical_count;
+  uint16_t  physical_count;
+  uint32_t  check;
+} wl_header_t;
+
+typedef struct
+{
+  uint16_t  logical;
+  uint16_t  physical;
+  uint32_t  erases;
+  uint32_t  sequence;
+  uint32_t  check;
+} wl_entry_t;
+
+typedef struct
+{
+  uint32_t      base;
+  uint16_t      logical_count;
+  uint16_t      physical_count;
+  uint32_t      bank_size;
+  uint32_t      table_size;
+  uint32_t      journal_size;
+
+  uint8_t      *table;
+  wl_header_t  *header;
+  uint16_t     *map;
+  uint32_t     *erases;
+  uint8_t      *state;
+
+  uint_fast8_t  bank;
+  uint32_t      journal_next;
+  uint32_t      rewrite_next;
+  uint16_t      rewrite_old;
+  bool          rewriting;
+} wl_volume_t;
+
+
+/* Module variables. */
+
+static wl_volume_t  m_volumes[USBFS_PARTITIONS];
+
+
+/* Functions.*/
+
+/*
+ * checksum - a simple FNV-1a hash, used to validate the tables in flash.
+ */
+
+static uint32_t wl_checksum( const void *p_data, uint32_t p_size_bytes )
+{
+  const uint8_t *l_data = p_data;
+  uint32_t       l_hash = 2166136261u;
+
+  while( p_size_bytes-- > 0 )
+  {
+    l_hash = ( l_hash ^ *l_data++ ) * 16777619u;
+  }
+  return l_hash;
+}
+
+
+/*
+ * layout - works out the size of the tables and banks needed for the given
+ *          number of logical sectors.
+ */
+
+static void wl_layout( wl_volume_t *p_volume, uint32_t p_logical_sectors )
+{
+  uint32_t l_map_size;
+
+  /* Work out how many sectors we're managing. */
+  p_volume->logical_count = p_logical_sectors;
+  p_volume->physical_count = p_logical_sectors + USBFS_WL_SPARES;
+
+  /* The table is the header, the map and the erase counts, padded to a page. */
+  l_map_size = ( p_volume->logical_count * sizeof( uint16_t ) + 3 ) & ~3;
+  p_volume->table_size = sizeof( wl_header_t ) + l_map_size + p_volume->physical_count * sizeof( uint32_t );
+  p_volume->table_size = ( p_volume->table_size + FLASH_PAGE_SIZE - 1 ) & ~( FLASH_PAGE_SIZE - 1 );
+
+  /* And each bank must hold that table, and a useful amount of journal. */
+  p_volume->bank_size = p_volume->table_size + WL_JOURNAL_MIN * sizeof( wl_entry_t );
+  p_volume->bank_size = ( p_volume->bank_size + FLASH_SECTOR_SIZE - 1 ) & ~( FLASH_SECTOR_SIZE - 1 );
+  p_volume->journal_size = ( p_volume->bank_size - p_volume->table_size ) / sizeof( wl_entry_t );
+
+  /* All done. */
+  return;
+}
+
+
+/*
+ * sector_address - returns the address within the flash region of a physical
+ *                  sector.
+ */
+
+static uint32_t wl_sector_address( const wl_volume_t *p_volume, uint16_t p_physical )
+{
+  return p_volume->base + p_volume->bank_size * 2 + p_physical * FLASH_SECTOR_SIZE;
+}
+
+
+/*
+ * bank_address - returns the address within the flash region of a bank.
+ */
+
+static uint32_t wl_bank_address( const wl_volume_t *p_volume, uint_fast8_t p_bank )
+{
+  return p_volume->base + p_bank * p_volume->bank_size;
+}
+
+
+/*
+ * sector_erased - checks to see if a physical sector is already erased.
+ */
+
+static bool wl_sector_erased( const wl_volume_t *p_volume, uint16_t p_physical )
+{
+  uint32_t      l_page[FLASH_PAGE_SIZE / sizeof( uint32_t )];
+  uint32_t      l_offset;
+  uint_fast16_t l_index;
+
+  /* Read a page at a time, looking for any cleared bits. */
+  for ( l_offset = 0; l_offset < FLASH_SECTOR_SIZE; l_offset += FLASH_PAGE_SIZE )
+  {
+    flashio_read( wl_sector_address( p_volume, p_physical ) + l_offset, l_page, FLASH_PAGE_SIZE );
+    for ( l_index = 0; l_index < FLASH_PAGE_SIZE / sizeof( uint32_t ); l_index++ )
+    {
+      if ( l_page[l_index] != 0xFFFFFFFF )
+      {
+        return false;
+      }
+    }
+  }
+
+  /* Nothing but ones, so it's erased. */
+  return true;
+}
+
+
+/*
+ * write_table - takes the next step in writing a fresh snapshot of our tables
+ *               into the other bank; a single sector erase, or the programming
+ *               of up to USBFS_PROGRAM_PAGES pages. Once it's all written,
+ *               p_done is set and the other bank becomes the active one, with
+ *               an empty journal. Returns false if the flash couldn't be
+ *               written, in which case the step should be tried again; until
+ *               then, the current bank remains in use.
+ */
+
+static bool wl_write_table( wl_volume_t *p_volume, bool *p_done )
+{
+  uint32_t      l_address, l_offset, l_length;
+  uint_fast8_t  l_bank;
+
+  /* Work out where we're writing to, and how far we've got. */
+  *p_done = false;
+  l_bank = p_volume->bank ^ 1;
+  l_address = wl_bank_address( p_volume, l_bank );
+  if ( !p_volume->rewriting )
+  {
+    p_volume->rewriting = true;
+    p_volume->rewrite_next = 0;
+  }
+
+  /* The other bank is erased first, a sector at a time. */
+  if ( p_volume->rewrite_next < p_volume->bank_size )
+  {
+    if ( !flashio_erase( l_address + p_volume->rewrite_next ) )
+    {
+      return false;
+    }
+    p_volume->rewrite_next += FLASH_SECTOR_SIZE;
+    if ( p_volume->rewrite_next < p_volume->bank_size )
+    {
+      return true;
+    }
+
+    /* Then update the header; the sequence tells us which bank is newest. */
+    p_volume->header->magic = WL_MAGIC;
+    p_volume->header->sequence++;
+    p_volume->header->logical_count = p_volume->logical_count;
+    p_volume->header->physical_count = p_volume->physical_count;
+    p_volume->header->check = wl_checksum( 
+      p_volume->table + sizeof( wl_header_t ), p_volume->table_size - sizeof( wl_header_t ) 
+    );
+    return true;
+  }
+
+  /* And write it out; the table is already laid out in memory as it is in flash. */
+  l_offset = p_volume->rewrite_next - p_volume->bank_size;
+  l_length = p_volume->table_size - l_offset;
+  if ( l_length > USBFS_PROGRAM_PAGES * FLASH_PAGE_SIZE )
+  {
+    l_length = USBFS_PROGRAM_PAGES * FLASH_PAGE_SIZE;
+  }
+  if ( !flashio_program( l_address + l_offset, p_volume->table + l_offset, l_length ) )
+  {
+    return false;
+  }
+  p_volume->rewrite_next += l_length;
+  if ( l_offset + l_length < p_volume->table_size )
+  {
+    return true;
+  }
+
+  /* The new bank is now the active one. */
+  p_volume->bank = l_bank;
+  p_volume->journal_next = 0;
+  p_volume->rewriting = false;
+  *p_done = true;
+  return true;
+}
+
+
+/*
+ * read_table - looks for the newest valid bank, and loads the tables from it,
+ *              applying any journal entries. Returns false if there's no
+ *              valid bank to be found.
+ */
+
+static bool wl_read_table( wl_volume_t *p_volume )
+{
+  wl_header_t   l_header;
+  wl_entry_t    l_entry;
+  uint32_t      l_sequence = 0;
+  uint_fast8_t  l_bank;
+  bool          l_found = false;
+
+  /* Check both banks, and remember the newest valid one. */
+  for ( l_bank = 0; l_bank < 2; l_bank++ )
+  {
+    flashio_read( wl_bank_address( p_volume, l_bank ), &l_header, sizeof( wl_header_t ) );
+    if ( ( l_header.magic != WL_MAGIC ) ||
+         ( l_header.logical_count != p_volume->logical_count ) ||
+         ( l_header.physical_count != p_volume->physical_count ) ||
+         ( l_found && ( l_header.sequence <= l_sequence ) ) )
+    {
+      continue;
+    }
+
+    /* Load the table, and make sure it's intact. */
+    flashio_read( wl_bank_address( p_volume, l_bank ), p_volume->table, p_volume->table_size );
+    if ( p_volume->header->check != wl_checksum( 
+           p_volume->table + sizeof( wl_header_t ), p_volume->table_size - sizeof( wl_header_t ) 
+         ) )
+    {
+      continue;
+    }
+
+    /* This is the best bank we've found so far. */
+    l_found = true;
+    l_sequence = l_header.sequence;
+    p_volume->bank = l_bank;
+  }
+
+  /* If we didn't find anything, there's nothing more to do. */
+  if ( !l_found )
+  {
+    return false;
+  }
+
+  /* We may have loaded a different bank after the good one, so reload. */
+  flashio_read( wl_bank_address( p_volume, p_volume->bank ), p_volume->table, p_volume->table_size );
+
+  /* Now replay the journal, until we find an empty (or damaged) entry. */
+  for ( p_volume->journal_next = 0; 
+        p_volume->journal_next < p_volume->journal_size; 
+        p_volume->journal_next++ )
+  {
+    flashio_read( 
+      wl_bank_address( p_volume, p_volume->bank ) + p_volume->table_size + 
+        p_volume->journal_next * sizeof( wl_entry_t ), 
+      &l_entry, sizeof( wl_entry_t ) 
+    );
+    if ( ( l_entry.sequence != p_volume->header->sequence ) ||
+         ( l_entry.check != wl_checksum( &l_entry, offsetof( wl_entry_t, check ) ) ) ||
+         ( l_entry.logical >= p_volume->logical_count ) ||
+         ( l_entry.physical >= p_volume->physical_count ) )
+    {
+      break;
+    }
+    p_volume->map[l_entry.logical] = l_entry.physical;
+    p_volume->erases[l_entry.physical] = l_entry.erases;
+  }
+
+  /* All done. */
+  return true;
+}
+
+
+/*
+ * init - sets up wear levelling for a partition, which starts at the given
+ *        address within the flash region; the existing map is loaded, or a
+ *        fresh one created. Returns false if we couldn't allocate memory for
+ *        the tables, or couldn't write a fresh map.
+ */
+
+bool wl_init( uint8_t p_part, uint32_t p_base, uint32_t p_logical_sectors )
+{
+  wl_volume_t  *l_volume = &m_volumes[p_part];
+  uint32_t      l_map_size;
+  uint16_t      l_index;
+  bool          l_done;
+
+  /* Work out our layout, and allocate the tables. */
+  wl_layout( l_volume, p_logical_sectors );
+  l_volume->base = p_base;
+  l_map_size = ( l_volume->logical_count * sizeof( uint16_t ) + 3 ) & ~3;
+  l_volume->table = (uint8_t *)malloc( l_volume->table_size );
+  l_volume->state = (uint8_t *)malloc( l_volume->physical_count );
+  if ( ( l_volume->table == NULL ) || ( l_volume->state == NULL ) )
+  {
+    free( l_volume->table );
+    free( l_volume->state );
+    return false;
+  }
+  memset( l_volume->table, 0xFF, l_volume->table_size );
+  l_volume->header = (wl_header_t *)l_volume->table;
+  l_volume->map = (uint16_t *)( l_volume->table + sizeof( wl_header_t ) );
+  l_volume->erases = (uint32_t *)( l_volume->table + sizeof( wl_header_t ) + l_map_size );
+
+  /* Load up the existing tables, if there are any. */
+  if ( !wl_read_table( l_volume ) )
+  {
+    /* Nope; so everything starts out where it would be without us. */
+    for ( l_index = 0; l_index < l_volume->logical_count; l_index++ )
+    {
+      l_volume->map[l_index] = USBFS_WL_SPARES + l_index;
+    }
+    memset( l_volume->erases, 0, l_volume->physical_count * sizeof( uint32_t ) );
+    l_volume->header->sequence = 0;
+    l_volume->bank = 1;
+    do
+    {
+      if ( !wl_write_table( l_volume, &l_done ) )
+      {
+        return false;
+      }
+    } while( !l_done );
+  }
+
+  /* Now work out which sectors are spare, and which of those are erased. */
+  memset( l_volume->state, WL_SECTOR_STALE, l_volume->physical_count );
+  for ( l_index = 0; l_index < l_volume->logical_count; l_index++ )
+  {
+    l_volume->state[l_volume->map[l_index]] = WL_SECTOR_MAPPED;
+  }
+  for ( l_index = 0; l_index < l_volume->physical_count; l_index++ )
+  {
+    if ( ( l_volume->state[l_index] == WL_SECTOR_STALE ) && wl_sector_erased( l_volume, l_index ) )
+    {
+      l_volume->state[l_index] = WL_SECTOR_ERASED;
+    }
+  }
+
+  /* All done. */
+  return true;
+}
+
+
+/*
+ * get_overhead - returns the number of extra sectors that wear levelling needs
+ *                on top of the requested number of logical sectors.
+ */
+
+uint32_t wl_get_overhead( uint32_t p_logical_sectors )
+{
+  wl_volume_t l_volume;
+
+  /* Work out the layout, and it's a simple sum. */
+  wl_layout( &l_volume, p_logical_sectors );
+  return ( l_volume.bank_size * 2 ) / FLASH_SECTOR_SIZE + USBFS_WL_SPARES;
+}
+
+
+/*
+ * address - returns the address within the flash region where the logical
+ *           sector currently lives.
+ */
+
+uint32_t wl_address( uint8_t p_part, uint32_t p_logical )
+{
+  return wl_sector_address( &m_volumes[p_part], m_volumes[p_part].map[p_logical] );
+}
+
+
+/*
+ * relocate - finds a spare sector to hold the new contents of a logical
+ *            sector, and returns its address. If that sector still needs to
+ *            be erased, p_erase is set and it is up to the caller to do so.
+ *            Once it has been written, wl_commit() must be called to make the
+ *            move permanent.
+ */
+
+uint32_t wl_relocate( uint8_t p_part, bool *p_erase )
+{
+  wl_volume_t  *l_volume = &m_volumes[p_part];
+  uint16_t      l_index, l_best = l_volume->physical_count;
+
+  /* Look for the least worn spare, preferring ones that are already erased. */
+  for ( l_index = 0; l_index < l_volume->physical_count; l_index++ )
+  {
+    if ( ( l_volume->state[l_index] != WL_SECTOR_ERASED ) && 
+         ( l_volume->state[l_index] != WL_SECTOR_STALE ) )
+    {
+      continue;
+    }
+    if ( ( l_best == l_volume->physical_count ) ||
+         ( l_volume->state[l_index] < l_volume->state[l_best] ) ||
+         ( ( l_volume->state[l_index] == l_volume->state[l_best] ) && 
+           ( l_volume->erases[l_index] < l_volume->erases[l_best] ) ) )
+    {
+      l_best = l_index;
+    }
+  }
+
+  /* If we didn't find an erased one, the caller will have to erase it. */
+  *p_erase = ( l_volume->state[l_best] == WL_SECTOR_STALE );
+  if ( *p_erase )
+  {
+    l_volume->erases[l_best]++;
+  }
+
+  /* Make sure nobody else picks it, and that's the one. */
+  l_volume->state[l_best] = WL_SECTOR_RESERVED;
+  return wl_sector_address( l_volume, l_best );
+}
+
+
+/*
+ * commit - records that the logical sector now lives at the given address (as
+ *          returned by wl_relocate()); the old physical sector becomes spare.
+ *          Usually that's a single journal entry, but if the journal is full
+ *          a fresh table is written instead, which takes several steps; the
+ *          caller should keep calling until p_done is set. Returns false if
+ *          the flash couldn't be written, in which case the step should be
+ *          retried.
+ */
+
+bool wl_commit( uint8_t p_part, uint32_t p_logical, uint32_t p_address, bool *p_done )
+{
+  wl_volume_t  *l_volume = &m_volumes[p_part];
+  wl_entry_t    l_entry;
+  uint8_t       l_page[FLASH_PAGE_SIZE];
+  uint32_t      l_offset;
+  uint16_t      l_physical, l_old_physical;
+
+  /* Work out which physical sectors are involved. */
+  *p_done = false;
+  l_physical = ( p_address - wl_sector_address( l_volume, 0 ) ) / FLASH_SECTOR_SIZE;
+  l_old_physical = l_volume->map[p_logical];
+
+  /* If the journal is full, a fresh table holds everything we need. */
+  if ( l_volume->journal_next >= l_volume->journal_size )
+  {
+    /* The move goes into the table before we start writing it out. */
+    if ( !l_volume->rewriting )
+    {
+      l_volume->rewrite_old = l_old_physical;
+      l_volume->map[p_logical] = l_physical;
+    }
+    l_old_physical = l_volume->rewrite_old;
+    if ( !wl_write_table( l_volume, p_done ) )
+    {
+      return false;
+    }
+    if ( !*p_done )
+    {
+      return true;
+    }
+  }
+  else
+  {
+    /* Otherwise, build a journal entry. */
+    l_entry.logical = p_logical;
+    l_entry.physical = l_physical;
+    l_entry.erases = l_volume->erases[l_physical];
+    l_entry.sequence = l_volume->header->sequence;
+    l_entry.check = wl_checksum( &l_entry, offsetof( wl_entry_t, check ) );
+
+    /* 
+     * Programming has to be done a page at a time; the rest of the page is
+     * either already programmed, or still erased, so we just write it back.
+     */
+    l_offset = wl_bank_address( l_volume, l_volume->bank ) + l_volume->table_size + 
+               l_volume->journal_next * sizeof( wl_entry_t );
+    flashio_read( l_offset & ~( FLASH_PAGE_SIZE - 1 ), l_page, FLASH_PAGE_SIZE );
+    memcpy( l_page + ( l_offset & ( FLASH_PAGE_SIZE - 1 ) ), &l_entry, sizeof( wl_entry_t ) );
+    if ( !flashio_program( l_offset & ~( FLASH_PAGE_SIZE - 1 ), l_page, FLASH_PAGE_SIZE ) )
+    {
+      return false;
+    }
+    l_volume->journal_next++;
+  }
+
+  /* Now it's safely recorded, update our in-memory tables. */
+  l_volume->state[l_old_physical] = WL_SECTOR_STALE;
+  l_volume->state[l_physical] = WL_SECTOR_MAPPED;
+  l_volume->map[p_logical] = l_physical;
+  *p_done = true;
+  return true;
+}
+
+
+/*
+ * maintain - erases one stale spare sector, so that a future relocation
+ *            doesn't have to wait for it. Returns true if there was work to
+ *            do, so it's intended to be called when the storage layer is idle.
+ */
+
+bool wl_maintain( void )
+{
+  wl_volume_t  *l_volume;
+  uint_fast8_t  l_part;
+  uint16_t      l_index;
+
+  /* Find the first spare that needs erasing, in any partition. */
+  for ( l_part = 0; l_part < USBFS_PARTITIONS; l_part++ )
+  {
+    l_volume = &m_volumes[l_part];
+    for ( l_index = 0; l_index < l_volume->physical_count; l_index++ )
+    {
+      if ( l_volume->state[l_index] == WL_SECTOR_STALE )
+      {
+        if ( flashio_erase( wl_sector_address( l_volume, l_index ) ) )
+        {
+          l_volume->erases[l_index]++;
+          l_volume->state[l_index] = WL_SECTOR_ERASED;
+        }
+        return true;
+      }
+    }
+  }
+
+  /* Nothing to do, then. */
+  return false;
+}
+
+
+/* End of file usbfs/wearlevel.c */